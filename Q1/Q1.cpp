@@ -1,4 +1,4 @@
-﻿// Compile with: g++ flat_shading_hw6.cpp -o main -lGL -lGLU -lglut
+﻿// Compile with: g++ flat_shading_hw6.cpp -o main -pthread -lGL -lGLU -lglut
 #include <GL/glut.h>
 #include <cmath>
 #include <vector>
@@ -6,10 +6,52 @@
 #include <iostream>
 #include <limits>
 #include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <emmintrin.h>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <sstream>
+#include <string>
+#include <deque>
+#include <functional>
+#include <type_traits>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <climits>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 const int WIDTH = 512, HEIGHT = 512;
-unsigned char framebuffer[HEIGHT][WIDTH][3];
-float zbuffer[HEIGHT][WIDTH];
+const int MAX_SAMPLES = 8;
+int msaaSamples = 4;
+
+const int TILE_SIZE = 32, BLOCK_SIZE = 8;
+const int ROWS_PER_TASK = 16;
+const size_t VERTICES_PER_TASK = 1024; // a multiple of the Vec3x4 width
+const size_t TRIANGLES_PER_TASK = 4096;
+const int TILES_X = (WIDTH + TILE_SIZE - 1) / TILE_SIZE, TILES_Y = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+const int TILE_COUNT = TILES_X * TILES_Y;
+const size_t ARENA_ALIGNMENT = 64, ARENA_BLOCK_SIZE = 1 << 20;
+
+static_assert(WIDTH % 4 == 0, "resolveSamples() and rasterize() process four pixels at a time");
+static_assert(TILE_SIZE % BLOCK_SIZE == 0 && BLOCK_SIZE % 4 == 0, "blocks must tile evenly into quads");
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -21,6 +63,7 @@ struct Vec3 {
     Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
     Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
     Vec3 operator*(float s) const { return Vec3(x * s, y * s, z * s); }
+    Vec3& operator+=(const Vec3& v) { x += v.x; y += v.y; z += v.z; return *this; }
     Vec3 cross(const Vec3& v) const {
         return Vec3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
     }
@@ -31,138 +74,2473 @@ struct Vec3 {
     }
 };
 
-std::vector<Vec3> vertices;
-std::vector<std::array<int, 3>> indices;
+// Four Vec3s in SoA form, one per SSE lane: the batch counterpart of Vec3 for the vectorized stages.
+// Lane masks come from the _mm_cmp*_ps comparisons and are consumed by select().
+struct Vec3x4 {
+    __m128 x, y, z;
+    Vec3x4() = default;
+    Vec3x4(__m128 a, __m128 b, __m128 c) : x(a), y(b), z(c) {}
+    explicit Vec3x4(const Vec3& v) : x(_mm_set1_ps(v.x)), y(_mm_set1_ps(v.y)), z(_mm_set1_ps(v.z)) {}
+    Vec3x4 operator+(const Vec3x4& v) const { return Vec3x4(_mm_add_ps(x, v.x), _mm_add_ps(y, v.y), _mm_add_ps(z, v.z)); }
+    Vec3x4 operator-(const Vec3x4& v) const { return Vec3x4(_mm_sub_ps(x, v.x), _mm_sub_ps(y, v.y), _mm_sub_ps(z, v.z)); }
+    Vec3x4 operator*(__m128 s) const { return Vec3x4(_mm_mul_ps(x, s), _mm_mul_ps(y, s), _mm_mul_ps(z, s)); }
+    Vec3x4& operator+=(const Vec3x4& v) { return *this = *this + v; }
+    Vec3x4 cross(const Vec3x4& v) const {
+        return Vec3x4(_mm_sub_ps(_mm_mul_ps(y, v.z), _mm_mul_ps(z, v.y)),
+                      _mm_sub_ps(_mm_mul_ps(z, v.x), _mm_mul_ps(x, v.z)),
+                      _mm_sub_ps(_mm_mul_ps(x, v.y), _mm_mul_ps(y, v.x)));
+    }
+    __m128 dot(const Vec3x4& v) const {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, v.x), _mm_mul_ps(y, v.y)), _mm_mul_ps(z, v.z));
+    }
+    // Correctly rounded sqrt and divide, so every lane matches Vec3::normalize() bit for bit and batched
+    // stages shade exactly as their scalar counterparts; zero-length lanes stay zero. Deliberately not
+    // rsqrt plus a Newton step, which is faster but moves Gouraud colors by a level against Vec3.
+    Vec3x4 normalize() const {
+        __m128 len = _mm_sqrt_ps(dot(*this));
+        __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), len);
+        return *this * _mm_and_ps(inv, _mm_cmpgt_ps(len, _mm_setzero_ps()));
+    }
+};
 
-void clearBuffers() {
-    for (int y = 0; y < HEIGHT; ++y)
-        for (int x = 0; x < WIDTH; ++x) {
-            framebuffer[y][x][0] = framebuffer[y][x][1] = framebuffer[y][x][2] = 0;
-            zbuffer[y][x] = std::numeric_limits<float>::infinity();
+__m128 select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+Vec3x4 select(__m128 mask, const Vec3x4& a, const Vec3x4& b) {
+    return Vec3x4(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+}
+
+// Loads up to four Vec3s; unused lanes repeat the first element so they stay finite.
+Vec3x4 loadVec3x4(const Vec3* v, size_t count = 4) {
+    alignas(16) float s[3][4];
+    for (size_t k = 0; k < 4; ++k) {
+        const Vec3& p = v[k < count ? k : 0];
+        s[0][k] = p.x; s[1][k] = p.y; s[2][k] = p.z;
+    }
+    return Vec3x4(_mm_load_ps(s[0]), _mm_load_ps(s[1]), _mm_load_ps(s[2]));
+}
+
+Vec3x4 gatherVec3x4(const Vec3* base, const int* idx, size_t count = 4) {
+    alignas(16) float s[3][4];
+    for (size_t k = 0; k < 4; ++k) {
+        const Vec3& p = base[idx[k < count ? k : 0]];
+        s[0][k] = p.x; s[1][k] = p.y; s[2][k] = p.z;
+    }
+    return Vec3x4(_mm_load_ps(s[0]), _mm_load_ps(s[1]), _mm_load_ps(s[2]));
+}
+
+void storeVec3x4(Vec3* out, const Vec3x4& v, size_t count = 4) {
+    alignas(16) float s[3][4];
+    _mm_store_ps(s[0], v.x); _mm_store_ps(s[1], v.y); _mm_store_ps(s[2], v.z);
+    for (size_t k = 0; k < count; ++k) out[k] = Vec3(s[0][k], s[1][k], s[2][k]);
+}
+
+// Row-major 4x4 matrix applied to column vectors (p' = M * p). Default-constructs to the identity.
+struct Mat4 {
+    alignas(16) float m[4][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } };
+
+    static Mat4 translation(const Vec3& t) {
+        Mat4 r;
+        r.m[0][3] = t.x; r.m[1][3] = t.y; r.m[2][3] = t.z;
+        return r;
+    }
+
+    // Rotation by `angle` radians around the unit vector `axis`.
+    static Mat4 rotation(const Vec3& axis, float angle) {
+        float c = std::cos(angle), s = std::sin(angle), k = 1 - c;
+        float x = axis.x, y = axis.y, z = axis.z;
+        Mat4 r;
+        r.m[0][0] = x * x * k + c;     r.m[0][1] = x * y * k - z * s; r.m[0][2] = x * z * k + y * s;
+        r.m[1][0] = y * x * k + z * s; r.m[1][1] = y * y * k + c;     r.m[1][2] = y * z * k - x * s;
+        r.m[2][0] = z * x * k - y * s; r.m[2][1] = z * y * k + x * s; r.m[2][2] = z * z * k + c;
+        return r;
+    }
+
+    // glFrustum: the camera looks down -z, and n and f are positive distances to the clip planes.
+    static Mat4 frustum(float l, float r, float b, float t, float n, float f) {
+        Mat4 p;
+        p.m[0][0] = 2 * n / (r - l); p.m[0][2] = (r + l) / (r - l);
+        p.m[1][1] = 2 * n / (t - b); p.m[1][2] = (t + b) / (t - b);
+        p.m[2][2] = -(f + n) / (f - n); p.m[2][3] = -2 * f * n / (f - n);
+        p.m[3][2] = -1; p.m[3][3] = 0;
+        return p;
+    }
+
+    Mat4 operator*(const Mat4& o) const {
+        Mat4 r;
+        for (int i = 0; i < 4; ++i) {
+            __m128 row = _mm_mul_ps(_mm_set1_ps(m[i][0]), _mm_load_ps(o.m[0]));
+            for (int k = 1; k < 4; ++k)
+                row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m[i][k]), _mm_load_ps(o.m[k])));
+            _mm_store_ps(r.m[i], row);
+        }
+        return r;
+    }
+
+    // Affine transforms only: the projective row is ignored.
+    Vec3 transformPoint(const Vec3& p) const {
+        return Vec3(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                    m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                    m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    // Inverse of a rotation followed by a translation.
+    Mat4 inverseRigid() const {
+        Mat4 r;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j) r.m[i][j] = m[j][i];
+        for (int i = 0; i < 3; ++i)
+            r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+        return r;
+    }
+};
+
+// Multiplies four points (w = 1) by m; returns x, y, z and sets w.
+inline Vec3x4 transformPoints(const Mat4& m, const Vec3x4& p, __m128& w) {
+    auto row = [&](int i) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m.m[i][0]), p.x), _mm_mul_ps(_mm_set1_ps(m.m[i][1]), p.y)),
+                          _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m.m[i][2]), p.z), _mm_set1_ps(m.m[i][3])));
+    };
+    w = row(3);
+    return Vec3x4(row(0), row(1), row(2));
+}
+
+// Fork/join bookkeeping for a set of tasks. Tasks submitted after a group start once it drains.
+struct TaskGroup {
+    std::atomic<int> pending{ 0 };
+    std::mutex mutex;
+    std::vector<std::pair<std::function<void()>, TaskGroup*>> continuations;
+};
+
+// Work-stealing pool that runs the parallel render stages and batch jobs; there is one per process,
+// see taskPool(). Workers push and pop their own tasks at the back of their deque and steal from the
+// front of the others'; other threads submit through a shared queue. wait() runs the group's own
+// queued tasks until it drains, so tasks can fork and join nested work without parking a worker, and
+// a waiting thread never picks up unrelated work such as another render's stages or a batch job.
+class TaskPool {
+public:
+    TaskPool(int workers, bool pin) : queues(workers + 1) {
+        for (auto& q : queues) q.reset(new Queue);
+        for (int i = 0; i < workers; ++i) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+            if (pin) pinThread(threads.back(), i + 1);
+        }
+    }
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    int workerCount() const { return (int)threads.size(); }
+
+    // Per-thread state, such as a render target's stats lanes, is indexed by threadSlot() below
+    // slotCount(). Worker i owns slot i; any other thread claims one of EXTERNAL_SLOTS on first use
+    // and gives it back when it exits, so no two live threads ever share a slot.
+    static const int EXTERNAL_SLOTS = 8;
+    int slotCount() const { return workerCount() + EXTERNAL_SLOTS; }
+
+    int threadSlot() {
+        if (workerIndex >= 0) return workerIndex;
+        thread_local ExternalSlot external;
+        if (!external.pool) {
+            std::lock_guard<std::mutex> lock(slotMutex);
+            int free = 0;
+            while (free < EXTERNAL_SLOTS && (usedSlots >> free & 1)) ++free;
+            if (free == EXTERNAL_SLOTS) {
+                std::cerr << "More than " << EXTERNAL_SLOTS << " threads outside the task pool\n";
+                std::abort();
+            }
+            usedSlots |= 1u << free;
+            external.pool = this;
+            external.slot = workerCount() + free;
         }
+        return external.slot;
+    }
+
+    void submit(std::function<void()> fn, TaskGroup& group, TaskGroup* after = nullptr) {
+        group.pending++;
+        if (after) {
+            std::lock_guard<std::mutex> lock(after->mutex);
+            if (after->pending > 0) {
+                after->continuations.emplace_back(std::move(fn), &group);
+                return;
+            }
+        }
+        push({ std::move(fn), &group });
+    }
+
+    void wait(TaskGroup& group) {
+        while (group.pending > 0)
+            if (!runOne(&group)) std::this_thread::yield();
+        std::lock_guard<std::mutex> lock(group.mutex); // the last task may still be releasing continuations
+    }
+
+    // Submits body(chunkBegin, chunkEnd) for each `grain`-sized chunk of [begin, end) without waiting.
+    template <class F>
+    void parallelFor(size_t begin, size_t end, size_t grain, F body, TaskGroup& group, TaskGroup* after = nullptr) {
+        for (size_t i = begin; i < end; i += grain) {
+            size_t chunkEnd = std::min(end, i + grain);
+            submit([body, i, chunkEnd] { body(i, chunkEnd); }, group, after);
+        }
+    }
+
+    template <class F>
+    void parallelFor(size_t begin, size_t end, size_t grain, F&& body) {
+        if (threads.empty() || end - begin <= grain) {
+            if (begin < end) body(begin, end);
+            return;
+        }
+        TaskGroup group;
+        parallelFor(begin, end, grain, [&body](size_t b, size_t e) { body(b, e); }, group);
+        wait(group);
+    }
+
+private:
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    struct ExternalSlot {
+        TaskPool* pool = nullptr;
+        int slot = -1;
+        ~ExternalSlot() {
+            if (!pool) return;
+            std::lock_guard<std::mutex> lock(pool->slotMutex);
+            pool->usedSlots &= ~(1u << (slot - pool->workerCount()));
+        }
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues; // one per worker, then the shared queue
+    std::vector<std::thread> threads;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int> queued{ 0 };
+    bool stopping = false;
+    std::mutex slotMutex;
+    uint32_t usedSlots = 0; // bit i: external slot i is held by a live thread
+    static inline thread_local int workerIndex = -1;
+
+    void push(Task task) {
+        Queue& q = *queues[workerIndex >= 0 ? workerIndex : queues.size() - 1];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(std::move(task));
+        }
+        queued++;
+        { std::lock_guard<std::mutex> lock(sleepMutex); }
+        wake.notify_one();
+    }
+
+    // With `only` set, takes the newest or oldest task of that group and leaves the rest queued.
+    bool pop(Queue& q, bool newest, Task& task, const TaskGroup* only) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) return false;
+        if (only) {
+            size_t n = q.tasks.size();
+            for (size_t k = 0; k < n; ++k) {
+                size_t i = newest ? n - 1 - k : k;
+                if (q.tasks[i].group != only) continue;
+                task = std::move(q.tasks[i]);
+                q.tasks.erase(q.tasks.begin() + i);
+                return true;
+            }
+            return false;
+        }
+        if (newest) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        return true;
+    }
+
+    // Own deque first (newest task, warmest cache), then the oldest task of the shared queue or another
+    // worker; only tasks of `only` when it is set.
+    bool runOne(const TaskGroup* only = nullptr) {
+        if (queued == 0) return false;
+        Task task;
+        int self = workerIndex, n = (int)queues.size();
+        bool found = self >= 0 && pop(*queues[self], true, task, only);
+        for (int i = 0; !found && i < n; ++i) {
+            int victim = (self + 1 + i) % n;
+            if (victim != self) found = pop(*queues[victim], false, task, only);
+        }
+        if (!found) return false;
+        queued--;
+        task.fn();
+        finish(*task.group);
+        return true;
+    }
+
+    void finish(TaskGroup& group) {
+        std::vector<std::pair<std::function<void()>, TaskGroup*>> released;
+        {
+            std::lock_guard<std::mutex> lock(group.mutex);
+            if (--group.pending == 0) released.swap(group.continuations);
+        }
+        for (auto& c : released) push({ std::move(c.first), c.second });
+    }
+
+    void workerLoop(int index) {
+        workerIndex = index;
+        for (;;) {
+            if (runOne()) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping) return;
+        }
+    }
+
+    static void pinThread(std::thread& t, int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+        (void)t; (void)cpu;
+#endif
+    }
+};
+
+int poolThreads = 0; // --threads; 0 means one per hardware thread
+bool poolPinning = false;
+
+// The calling thread joins in while it waits, so the pool gets one worker fewer than the thread count.
+TaskPool& taskPool() {
+    static TaskPool pool((poolThreads > 0 ? poolThreads : (int)std::max(1u, std::thread::hardware_concurrency())) - 1, poolPinning);
+    return pool;
+}
+
+// Pipeline statistics. Per-stage timers are built in everywhere: they read the clock around each
+// stage and task, which is lost in the noise of a frame, so --stats reports stage times from any build.
+// The Debug configurations also define PIPELINE_STATS=1 for the triangle, pixel, depth and shader
+// counters, the --view heatmaps and a separate shade stage. Shading is then timed per 8x8 block or per
+// small triangle, which adds around 15% to a typical frame and more on meshes of pixel-sized
+// triangles; without it, shading time is part of raster.
+#ifndef PIPELINE_STATS
+#define PIPELINE_STATS 0
+#endif
+
+enum Stage { STAGE_CLEAR, STAGE_VERTEX, STAGE_SHADOW, STAGE_BIN, STAGE_RASTER, STAGE_SHADE, STAGE_RESOLVE, STAGE_PRESENT, STAGE_COUNT };
+const char* const stageNames[STAGE_COUNT] = { "clear", "vertex", "shadow", "bin", "raster", "shade", "resolve", "present" };
+
+struct PipelineStats {
+    uint64_t trianglesSubmitted = 0, trianglesCulled = 0, trianglesRasterized = 0;
+    uint64_t pixelsTested = 0, pixelsCovered = 0;
+    uint64_t depthPassed = 0, depthFailed = 0;
+    uint64_t shaderInvocations = 0;
+    uint64_t stageNs[STAGE_COUNT] = {}; // summed over every thread that worked on the stage
+};
+
+// Counters and stage timer for one thread working on a target, one lane per TaskPool::threadSlot().
+// render() sums the lanes into RenderTarget::stats.
+struct StatsLane {
+    PipelineStats stats;
+    int currentStage = STAGE_COUNT;
+    std::chrono::steady_clock::time_point stageStart;
+};
+
+// One JSON object, every line prefixed with `indent`, without a trailing newline.
+// Builds without PIPELINE_STATS have no counters to report and write only "stage_ns".
+void writePipelineStatsJson(std::ostream& out, const PipelineStats& s, const char* indent = "") {
+    out << "{\n";
+    if (PIPELINE_STATS)
+        out << indent << "  \"triangles\": { \"submitted\": " << s.trianglesSubmitted << ", \"culled\": " << s.trianglesCulled
+            << ", \"rasterized\": " << s.trianglesRasterized << " },\n"
+            << indent << "  \"pixels\": { \"tested\": " << s.pixelsTested << ", \"covered\": " << s.pixelsCovered << " },\n"
+            << indent << "  \"depth\": { \"passed\": " << s.depthPassed << ", \"failed\": " << s.depthFailed << " },\n"
+            << indent << "  \"shader_invocations\": " << s.shaderInvocations << ",\n";
+    out << indent << "  \"stage_ns\": {";
+    for (int i = 0; i < STAGE_COUNT; ++i)
+        out << (i ? ", " : " ") << "\"" << stageNames[i] << "\": " << s.stageNs[i];
+    out << " }\n" << indent << "}";
+}
+
+// The headless modes write a JSON array with one entry per streamed frame or batch job, in order:
+// "[" first, then an entry per render, then "\n]\n".
+void writePipelineStatsEntry(std::ostream& out, size_t index, const PipelineStats& s) {
+    out << (index ? ",\n  " : "\n  ");
+    writePipelineStatsJson(out, s, "  ");
+}
+
+const char* statsPath = nullptr; // --stats; the window rewrites it for each presented frame
+
+// Heatmap debug views replace the shaded image with per-pixel (or per-tile) cost.
+enum class DebugView { None, BBoxTests, Overdraw, ShaderInvocations, TileTime };
+DebugView debugView = DebugView::None;
+
+const int SHADOW_SIZE = 512;
+const float SHADOW_BIAS = 0.02f, SHADOW_NORMAL_OFFSET = 0.05f;
+
+// Depth from the light's point of view, perspective-projected to fit the mesh bounds. Texels hold
+// -1/z (z along the light's forward axis) so depth interpolates linearly in shadow-map space.
+struct ShadowMap {
+    alignas(16) float depth[SHADOW_SIZE][SHADOW_SIZE];
+    Vec3 origin, right, up, forward;
+    float scale; // texels per unit of lateral offset over distance
+
+    // Returns texel coordinates and the linear light-space depth.
+    Vec3 project(const Vec3& p) const {
+        Vec3 rel = p - origin;
+        float z = rel.dot(forward);
+        return Vec3(SHADOW_SIZE * 0.5f + rel.dot(right) * scale / z, SHADOW_SIZE * 0.5f + rel.dot(up) * scale / z, z);
+    }
+
+    // Percentage-closer filter over a 4x4 texel footprint, one SSE compare per row.
+    float visibility(const Vec3& pos, const Vec3& N) const {
+        Vec3 p = project(pos + N * SHADOW_NORMAL_OFFSET);
+        if (p.z <= SHADOW_BIAS) return 1.0f;
+        int x = std::clamp((int)std::floor(p.x - 1.5f), 0, SHADOW_SIZE - 4);
+        int y = std::clamp((int)std::floor(p.y - 1.5f), 0, SHADOW_SIZE - 4);
+        const __m128 ref = _mm_set1_ps(-1.0f / (p.z - SHADOW_BIAS)), one = _mm_set1_ps(1.0f);
+        __m128 lit = _mm_setzero_ps();
+        for (int r = 0; r < 4; ++r)
+            lit = _mm_add_ps(lit, _mm_and_ps(_mm_cmple_ps(ref, _mm_loadu_ps(&depth[y + r][x])), one));
+        lit = _mm_add_ps(lit, _mm_movehl_ps(lit, lit));
+        lit = _mm_add_ss(lit, _mm_shuffle_ps(lit, lit, 1));
+        return _mm_cvtss_f32(lit) * (1.0f / 16.0f);
+    }
+
+    __m128 visibility(const Vec3x4& pos, const Vec3x4& N) const {
+        Vec3 p[4], n[4];
+        alignas(16) float v[4];
+        storeVec3x4(p, pos);
+        storeVec3x4(n, N);
+        for (int k = 0; k < 4; ++k) v[k] = visibility(p[k], n[k]);
+        return _mm_load_ps(v);
+    }
+};
+
+// Bump allocator for data that lives for one frame: allocate() advances a pointer within the
+// current block and reset() releases everything at once. Blocks are kept across frames, and a frame
+// that spilled into several is followed by one block of their combined size, so once the high-water
+// mark is known a frame makes no heap allocations. Memory is uninitialized and never destructed.
+class FrameArena {
+public:
+    template <class T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value && alignof(T) <= ARENA_ALIGNMENT, "arena types are plain data");
+        size_t bytes = (count * sizeof(T) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        if (blocks.empty() || used + bytes > capacity) grow(bytes); // count 0 on a fresh arena still needs a block
+        T* p = reinterpret_cast<T*>(blocks.back().get()->bytes + used);
+        used += bytes;
+        return p;
+    }
+
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = spilled + used;
+            blocks.clear();
+            blocks.emplace_back(new Chunk[total / sizeof(Chunk)]);
+            capacity = total;
+        }
+        used = spilled = 0;
+    }
+
+private:
+    struct alignas(ARENA_ALIGNMENT) Chunk {
+        unsigned char bytes[ARENA_ALIGNMENT];
+    };
+
+    std::vector<std::unique_ptr<Chunk[]>> blocks;
+    size_t used = 0, capacity = 0, spilled = 0; // spilled: bytes used in blocks before the current one
+
+    void grow(size_t bytes) {
+        size_t size = std::max({ bytes, capacity * 2, ARENA_BLOCK_SIZE });
+        blocks.emplace_back(new Chunk[size / sizeof(Chunk)]);
+        spilled += used;
+        used = 0;
+        capacity = size;
+    }
+};
+
+// One frame's pixels outside frameBuffers, e.g. a batch runner's. alignas keeps every row on the
+// 16-byte boundary resolveSamples() stores to, also where operator new only guarantees 8 (Win32).
+struct alignas(16) FramePixels {
+    uint32_t rows[HEIGHT][WIDTH];
+};
+
+// Everything a render() call writes. A target serves one render() at a time, whose stages fan out
+// over the task pool.
+struct RenderTarget {
+    // One depth and one color plane per MSAA sample, allocated for the msaaSamples parseArgs() settled on.
+    using DepthPlane = float[HEIGHT][WIDTH];
+    using ColorPlane = float[3][HEIGHT][WIDTH];
+    std::unique_ptr<DepthPlane[]> zbuffer{ new DepthPlane[msaaSamples] };
+    std::unique_ptr<ColorPlane[]> colorSamples{ new ColorPlane[msaaSamples] };
+    uint32_t (*framebuffer)[WIDTH] = nullptr; // resolve destination, RGBA8 pixels (see packPixel()); rows 16-byte aligned
+    unsigned char* ppmPixels = nullptr; // when set, resolve writes top-down RGB here instead (see MappedPPM)
+    uint32_t heatCounts[HEIGHT][WIDTH];
+    uint64_t tileNs[TILES_Y][TILES_X];
+    bool tileCleared[TILES_Y][TILES_X]; // whether clearTile() has run for the tile this frame
+    int width = WIDTH, height = HEIGHT; // viewport within the buffers; lowered by dynamic resolution
+    // Stage outputs, allocated from frameArena (see render()).
+    Vec3 *screenVertices = nullptr, *faceColors = nullptr;
+    // Tile i = ty * TILES_X + tx draws binnedTriangles[binOffsets[i] .. binOffsets[i + 1]), in mesh order.
+    const uint32_t *binOffsets = nullptr, *binnedTriangles = nullptr;
+    ShadowMap shadowMap;
+    // Transient per-frame data: frameArena for the serial parts of the frame, one arena per thread
+    // (by TaskPool::threadSlot(), like lanes) for scratch inside parallel tasks. Both reset at frame end.
+    FrameArena frameArena;
+    std::vector<FrameArena> threadArenas = std::vector<FrameArena>(taskPool().slotCount());
+    PipelineStats stats;
+    std::vector<StatsLane> lanes = std::vector<StatsLane>(taskPool().slotCount());
+};
+
+inline int countBits(unsigned v) {
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    return (int)((((v + (v >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+}
+
+// Charges the time since the last switch to the running stage; STAGE_COUNT means "not in a stage".
+void enterStage(StatsLane& lane, int stage) {
+    auto now = std::chrono::steady_clock::now();
+    if (lane.currentStage != STAGE_COUNT)
+        lane.stats.stageNs[lane.currentStage] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - lane.stageStart).count();
+    lane.currentStage = stage;
+    lane.stageStart = now;
 }
 
-void setPixel(int x, int y, const Vec3& color) {
-    if (x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT) return;
-    framebuffer[y][x][0] = (unsigned char)(std::pow(std::clamp(color.x, 0.0f, 1.0f), 1.0f / 2.2f) * 255.0f);
-    framebuffer[y][x][1] = (unsigned char)(std::pow(std::clamp(color.y, 0.0f, 1.0f), 1.0f / 2.2f) * 255.0f);
-    framebuffer[y][x][2] = (unsigned char)(std::pow(std::clamp(color.z, 0.0f, 1.0f), 1.0f / 2.2f) * 255.0f);
+StatsLane& statsLane(RenderTarget& target) { return target.lanes[taskPool().threadSlot()]; }
+FrameArena& threadArena(RenderTarget& target) { return target.threadArenas[taskPool().threadSlot()]; }
+
+// Times the enclosing task under `stage` on the calling thread's lane, then resumes what that lane was timing.
+struct StageScope {
+    StatsLane& lane;
+    int previous;
+    StageScope(RenderTarget& target, int stage) : lane(statsLane(target)), previous(lane.currentStage) { enterStage(lane, stage); }
+    ~StageScope() { enterStage(lane, previous); }
+};
+
+#define STATS_STAGE(target, stage) enterStage(statsLane(target), stage)
+#define STATS_SCOPE(target, stage) StageScope stageScope(target, stage)
+#if PIPELINE_STATS
+#define STATS_COUNT(target, field, n) (statsLane(target).stats.field += (n))
+#define HEAT_COUNT(target, view, x, y) (debugView == (view) ? (void)++(target).heatCounts[y][x] : (void)0)
+#else
+#define STATS_COUNT(target, field, n) ((void)0)
+#define HEAT_COUNT(target, view, x, y) ((void)0)
+#endif
+
+const PipelineStats& getPipelineStats(const RenderTarget& target) { return target.stats; }
+
+void resetPipelineStats(RenderTarget& target) {
+    target.stats = PipelineStats();
+    for (StatsLane& lane : target.lanes) lane = StatsLane();
+}
+
+void mergePipelineStats(RenderTarget& target) {
+    PipelineStats& s = target.stats;
+    for (const StatsLane& lane : target.lanes) {
+        const PipelineStats& l = lane.stats;
+        s.trianglesSubmitted += l.trianglesSubmitted;
+        s.trianglesCulled += l.trianglesCulled;
+        s.trianglesRasterized += l.trianglesRasterized;
+        s.pixelsTested += l.pixelsTested;
+        s.pixelsCovered += l.pixelsCovered;
+        s.depthPassed += l.depthPassed;
+        s.depthFailed += l.depthFailed;
+        s.shaderInvocations += l.shaderInvocations;
+        for (int i = 0; i < STAGE_COUNT; ++i) s.stageNs[i] += l.stageNs[i];
+    }
+}
+
+struct Mesh {
+    std::vector<Vec3> vertices;
+    std::vector<std::array<int, 3>> indices;
+};
+
+struct CompactMesh;
+
+// Vertices and triangles for one draw: a Mesh's stream, or a CompactMesh that is decoded where it is
+// read (see positionAt() and loadPositions()), in which case the stream pointer is null.
+struct MeshView {
+    const Vec3* vertices;
+    size_t vertexCount;
+    const std::array<int, 3>* indices;
+    size_t triangleCount;
+    const CompactMesh* compact;
+};
+
+MeshView viewOf(const Mesh& mesh) {
+    return { mesh.vertices.data(), mesh.vertices.size(), mesh.indices.data(), mesh.indices.size(), nullptr };
 }
 
-void applyTransform(Vec3& v) {
-    float l = -0.1f, r = 0.1f, b = -0.1f, t = 0.1f, n = -0.1f, f = -1000.0f;
+struct SampleOffset { float x, y; };
+
+// Standard 4x/8x MSAA positions in 1/16 pixel units, relative to the pixel center.
+const SampleOffset samplePattern1[1] = { { 0, 0 } };
+const SampleOffset samplePattern4[4] = {
+    { -2 / 16.0f, -6 / 16.0f }, { 6 / 16.0f, -2 / 16.0f }, { -6 / 16.0f, 2 / 16.0f }, { 2 / 16.0f, 6 / 16.0f }
+};
+const SampleOffset samplePattern8[8] = {
+    { 1 / 16.0f, -3 / 16.0f }, { -1 / 16.0f, 3 / 16.0f }, { 5 / 16.0f, 1 / 16.0f }, { -3 / 16.0f, -5 / 16.0f },
+    { -5 / 16.0f, 5 / 16.0f }, { -7 / 16.0f, -1 / 16.0f }, { 3 / 16.0f, 7 / 16.0f }, { 7 / 16.0f, -7 / 16.0f }
+};
+
+const SampleOffset* samplePattern() {
+    if (msaaSamples == 8) return samplePattern8;
+    if (msaaSamples == 4) return samplePattern4;
+    return samplePattern1;
+}
+
+// Clears lazily: only the per-tile flags are reset here. A tile's samples are reset by clearTile() when
+// its first triangle arrives, and tiles no triangle touches resolve straight to the background.
+void clearBuffers(RenderTarget& target) {
+    std::memset(target.tileCleared, 0, sizeof(target.tileCleared));
+    if (debugView != DebugView::None) {
+        std::memset(target.heatCounts, 0, sizeof(target.heatCounts));
+        std::memset(target.tileNs, 0, sizeof(target.tileNs));
+    }
+}
+
+void clearTile(RenderTarget& target, int tx, int ty) {
+    STATS_SCOPE(target, STAGE_CLEAR);
+    int x0 = tx * TILE_SIZE, n = std::min(target.width, x0 + TILE_SIZE) - x0;
+    int y0 = ty * TILE_SIZE, y1 = std::min(target.height, y0 + TILE_SIZE);
+    for (int s = 0; s < msaaSamples; ++s) {
+        for (int y = y0; y < y1; ++y) {
+            std::fill(&target.zbuffer[s][y][x0], &target.zbuffer[s][y][x0] + n, std::numeric_limits<float>::infinity());
+            for (int c = 0; c < 3; ++c)
+                std::fill(&target.colorSamples[s][c][y][x0], &target.colorSamples[s][c][y][x0] + n, 0.0f);
+        }
+    }
+    target.tileCleared[ty][tx] = true;
+}
+
+// Framebuffer pixels are RGBA8 with red in the lowest byte, i.e. R, G, B, A in memory (GL_RGBA) on
+// little-endian targets. Alpha is always opaque.
+const uint32_t OPAQUE_ALPHA = 0xff000000u;
+const uint32_t BACKGROUND_PIXEL = OPAQUE_ALPHA; // what a cleared pixel resolves to
+
+inline uint32_t packPixel(unsigned r, unsigned g, unsigned b) { return r | g << 8 | b << 16 | OPAQUE_ALPHA; }
+
+inline unsigned gammaByte(float c) { return (unsigned)(std::pow(std::clamp(c, 0.0f, 1.0f), 1.0f / 2.2f) * 255.0f); }
+
+const Mat4 projection = Mat4::frustum(-0.1f, 0.1f, -0.1f, 0.1f, 0.1f, 1000.0f);
 
-    float x = (2 * n * v.x) / (r - l);
-    float y = (2 * n * v.y) / (t - b);
-    float z = (f + n) / (f - n) * v.z + (2 * f * n) / (f - n);
-    float w = -v.z;
+// Object space to screen space: clip = mvp * v, then the perspective divide and a width x height viewport.
+void applyTransform(Vec3& v, const Mat4& mvp, float width, float height) {
+    const float (*m)[4] = mvp.m;
+    float x = m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3];
+    float y = m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3];
+    float z = m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3];
+    float w = m[3][0] * v.x + m[3][1] * v.y + m[3][2] * v.z + m[3][3];
 
     x /= w; y /= w; z /= w;
-    v.x = ((x + 1) * 0.5f) * WIDTH;
-    v.y = ((y + 1) * 0.5f) * HEIGHT;
+    v.x = ((x + 1) * 0.5f) * width;
+    v.y = ((y + 1) * 0.5f) * height;
     v.z = z;
 }
 
-void createSphere(int width = 32, int height = 16) {
-    float radius = 2.0f;
-    for (int j = 1; j < height - 1; ++j) {
-        float theta = M_PI * j / (height - 1);
-        for (int i = 0; i < width; ++i) {
-            float phi = 2 * M_PI * i / width + M_PI;
-            float x = -radius * sinf(theta) * cosf(phi);
-            float y = radius * cosf(theta);
-            float z = -radius * sinf(theta) * sinf(phi);
-            vertices.emplace_back(x, y, z - 7.0f);
+void applyTransform(Vec3x4& v, const Mat4& mvp, float width, float height) {
+    __m128 w;
+    Vec3x4 clip = transformPoints(mvp, v, w);
+    __m128 invW = _mm_div_ps(_mm_set1_ps(1.0f), w);
+    const __m128 half = _mm_set1_ps(0.5f);
+    v.x = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(clip.x, invW), _mm_set1_ps(1.0f)), _mm_mul_ps(half, _mm_set1_ps(width)));
+    v.y = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(clip.y, invW), _mm_set1_ps(1.0f)), _mm_mul_ps(half, _mm_set1_ps(height)));
+    v.z = _mm_mul_ps(clip.z, invW);
+}
+
+// Rasterizes the part of a triangle inside tile (tx, ty). Tiles run in parallel, so nothing outside
+// the tile is read or written; culling is counted once per triangle by binTriangles().
+// Coverage and depth are tested per sample, but shade(w0, w1, w2) runs once per pixel:
+// at the pixel center, or at the first visible sample when the center is outside.
+template <class ShadeFn>
+void rasterize(RenderTarget& target, int tx, int ty, const Vec3& v0, const Vec3& v1, const Vec3& v2, ShadeFn&& shade) {
+    int tileX1 = std::min(target.width, tx * TILE_SIZE + TILE_SIZE) - 1, tileY1 = std::min(target.height, ty * TILE_SIZE + TILE_SIZE) - 1;
+    int minX = std::max({ 1, tx * TILE_SIZE, (int)std::floor(std::min({ v0.x, v1.x, v2.x })) });
+    int maxX = std::min({ target.width - 2, tileX1, (int)std::ceil(std::max({ v0.x, v1.x, v2.x })) });
+    int minY = std::max({ 1, ty * TILE_SIZE, (int)std::floor(std::min({ v0.y, v1.y, v2.y })) });
+    int maxY = std::min({ target.height - 2, tileY1, (int)std::ceil(std::max({ v0.y, v1.y, v2.y })) });
+
+    float denom = (v1.y - v2.y) * (v0.x - v2.x) + (v2.x - v1.x) * (v0.y - v2.y);
+    if (denom == 0 || minX > maxX || minY > maxY) return;
+    float a0 = (v1.y - v2.y) / denom, b0 = (v2.x - v1.x) / denom;
+    float a1 = (v2.y - v0.y) / denom, b1 = (v0.x - v2.x) / denom;
+
+    const SampleOffset* pattern = samplePattern();
+
+    // Counted locally and added to the thread's stats lane once per call.
+    [[maybe_unused]] uint64_t pixelsTested = 0, pixelsCovered = 0, depthPassed = 0, depthFailed = 0;
+
+    auto writeColor = [&](int x, int y, unsigned mask, const Vec3& color) {
+        for (int s = 0; s < msaaSamples; ++s) {
+            if (!(mask & (1u << s))) continue;
+            target.colorSamples[s][0][y][x] = color.x;
+            target.colorSamples[s][1][y][x] = color.y;
+            target.colorSamples[s][2][y][x] = color.z;
+        }
+    };
+
+    // With statistics on, visible pixels of the current block or stamp wait here until shadePending()
+    // shades them together, so the stage timer switches to SHADE and back once per block rather than
+    // around every pixel. Without them each pixel is shaded as soon as it passes the depth test.
+    struct PendingPixel {
+        int x, y;
+        unsigned mask;
+        float w0, w1;
+    };
+    PendingPixel pending[PIPELINE_STATS ? BLOCK_SIZE * BLOCK_SIZE : 1];
+    int pendingCount = 0;
+
+    // Everything after coverage and the depth test for a covered pixel, shared by the stamp and tiled paths.
+    auto queuePixel = [&](int x, int y, [[maybe_unused]] unsigned covered, unsigned mask, const float* depth) {
+#if PIPELINE_STATS
+        pixelsCovered++;
+        depthPassed += countBits(mask);
+        depthFailed += countBits(covered & ~mask);
+#endif
+        if (!mask) return;
+        HEAT_COUNT(target, DebugView::Overdraw, x, y);
+
+        float dx = x - v2.x, dy = y - v2.y;
+        float w0 = a0 * dx + b0 * dy;
+        float w1 = a1 * dx + b1 * dy;
+        if (w0 < 0 || w1 < 0 || w0 + w1 > 1.0f) {
+            int s = 0;
+            while (!(mask & (1u << s))) ++s;
+            dx += pattern[s].x; dy += pattern[s].y;
+            w0 = a0 * dx + b0 * dy;
+            w1 = a1 * dx + b1 * dy;
+        }
+        for (int s = 0; s < msaaSamples; ++s)
+            if (mask & (1u << s)) target.zbuffer[s][y][x] = depth[s];
+        if constexpr (PIPELINE_STATS) pending[pendingCount++] = { x, y, mask, w0, w1 };
+        else writeColor(x, y, mask, shade(w0, w1, 1.0f - w0 - w1));
+    };
+
+    auto shadePending = [&] {
+#if PIPELINE_STATS
+        if (!pendingCount) return;
+        STATS_STAGE(target, STAGE_SHADE);
+        for (int i = 0; i < pendingCount; ++i) {
+            const PendingPixel& p = pending[i];
+            writeColor(p.x, p.y, p.mask, shade(p.w0, p.w1, 1.0f - p.w0 - p.w1));
+            HEAT_COUNT(target, DebugView::ShaderInvocations, p.x, p.y);
+        }
+        STATS_STAGE(target, STAGE_RASTER);
+        STATS_COUNT(target, shaderInvocations, pendingCount);
+        pendingCount = 0;
+#endif
+    };
+
+    auto commitStats = [&] {
+        STATS_COUNT(target, pixelsTested, pixelsTested);
+        STATS_COUNT(target, pixelsCovered, pixelsCovered);
+        STATS_COUNT(target, depthPassed, depthPassed);
+        STATS_COUNT(target, depthFailed, depthFailed);
+    };
+
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 a0x = _mm_set1_ps(a0), b0x = _mm_set1_ps(b0), a1x = _mm_set1_ps(a1), b1x = _mm_set1_ps(b1);
+    const __m128 z0 = _mm_set1_ps(v0.z), z1 = _mm_set1_ps(v1.z), z2 = _mm_set1_ps(v2.z);
+
+    // Coverage and depth for the pixels of row y selected by `columns` among sx..sx+3, one sample
+    // across four pixels per iteration with the same arithmetic as a scalar edge test. `inside`
+    // skips the edge tests for blocks known to be fully covered.
+    auto rasterizeQuad = [&](int sx, int y, unsigned columns, bool inside) {
+        const __m128 px = _mm_set_ps(sx + 3.0f, sx + 2.0f, sx + 1.0f, (float)sx);
+        alignas(16) float z[MAX_SAMPLES][4];
+        unsigned in[MAX_SAMPLES], pass[MAX_SAMPLES], any = 0;
+        for (int s = 0; s < msaaSamples; ++s) {
+            __m128 dx = _mm_sub_ps(_mm_add_ps(px, _mm_set1_ps(pattern[s].x)), _mm_set1_ps(v2.x));
+            __m128 dy = _mm_set1_ps(y + pattern[s].y - v2.y);
+            __m128 w0 = _mm_add_ps(_mm_mul_ps(a0x, dx), _mm_mul_ps(b0x, dy));
+            __m128 w1 = _mm_add_ps(_mm_mul_ps(a1x, dx), _mm_mul_ps(b1x, dy));
+            __m128 w2 = _mm_sub_ps(_mm_sub_ps(one, w0), w1);
+            __m128 zs = _mm_add_ps(_mm_add_ps(_mm_mul_ps(w0, z0), _mm_mul_ps(w1, z1)), _mm_mul_ps(w2, z2));
+            in[s] = inside ? columns : _mm_movemask_ps(_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)),
+                                                                  _mm_cmpge_ps(w2, zero))) & columns;
+            pass[s] = _mm_movemask_ps(_mm_cmplt_ps(zs, _mm_loadu_ps(&target.zbuffer[s][y][sx]))) & in[s];
+            _mm_store_ps(z[s], zs);
+            any |= in[s];
+        }
+#if PIPELINE_STATS
+        pixelsTested += countBits(columns);
+        for (int k = 0; k < 4; ++k)
+            if (columns & (1u << k)) HEAT_COUNT(target, DebugView::BBoxTests, sx + k, y);
+#endif
+        for (int k = 0; k < 4; ++k) {
+            if (!(any & (1u << k))) continue;
+            unsigned covered = 0, mask = 0;
+            float depth[MAX_SAMPLES];
+            for (int s = 0; s < msaaSamples; ++s) {
+                covered |= ((in[s] >> k) & 1u) << s;
+                mask |= ((pass[s] >> k) & 1u) << s;
+                depth[s] = z[s][k];
+            }
+            queuePixel(sx + k, y, covered, mask, depth);
+        }
+    };
+
+    // Triangles whose bounds fit in a 4x4 stamp skip the block walk.
+    if (maxX - minX < 4 && maxY - minY < 4) {
+        int sx = std::min(minX, tileX1 - 3);
+        unsigned columns = ((1u << (maxX - minX + 1)) - 1) << (minX - sx);
+        for (int y = minY; y <= maxY; ++y)
+            rasterizeQuad(sx, y, columns, false);
+        shadePending();
+        commitStats();
+        return;
+    }
+
+    // Larger triangles are walked in BLOCK_SIZE blocks. A block's sample extent is
+    // bounded per edge with the same rounding as the per-sample test, so rejected blocks contain no
+    // covered sample and accepted blocks no uncovered one.
+    float offMinX = pattern[0].x, offMaxX = pattern[0].x, offMinY = pattern[0].y, offMaxY = pattern[0].y;
+    for (int s = 1; s < msaaSamples; ++s) {
+        offMinX = std::min(offMinX, pattern[s].x); offMaxX = std::max(offMaxX, pattern[s].x);
+        offMinY = std::min(offMinY, pattern[s].y); offMaxY = std::max(offMaxY, pattern[s].y);
+    }
+    auto edgeBounds = [](float a, float b, float dx0, float dx1, float dy0, float dy1, float& lo, float& hi) {
+        float ax0 = a * dx0, ax1 = a * dx1, by0 = b * dy0, by1 = b * dy1;
+        lo = std::min(ax0, ax1) + std::min(by0, by1);
+        hi = std::max(ax0, ax1) + std::max(by0, by1);
+    };
+
+    for (int by = minY - minY % BLOCK_SIZE; by <= maxY; by += BLOCK_SIZE) {
+        int ry0 = std::max(minY, by), ry1 = std::min(maxY, by + BLOCK_SIZE - 1);
+        for (int bx = minX - minX % BLOCK_SIZE; bx <= maxX; bx += BLOCK_SIZE) {
+            int rx0 = std::max(minX, bx), rx1 = std::min(maxX, bx + BLOCK_SIZE - 1);
+            float dx0 = rx0 + offMinX - v2.x, dx1 = rx1 + offMaxX - v2.x;
+            float dy0 = ry0 + offMinY - v2.y, dy1 = ry1 + offMaxY - v2.y;
+            float lo0, hi0, lo1, hi1;
+            edgeBounds(a0, b0, dx0, dx1, dy0, dy1, lo0, hi0);
+            edgeBounds(a1, b1, dx0, dx1, dy0, dy1, lo1, hi1);
+            if (hi0 < 0 || hi1 < 0 || 1.0f - lo0 - lo1 < 0) continue;
+            bool inside = lo0 >= 0 && lo1 >= 0 && 1.0f - hi0 - hi1 >= 0;
+
+            for (int y = ry0; y <= ry1; ++y) {
+                for (int sx = rx0 & ~3; sx <= rx1; sx += 4) {
+                    int c0 = std::max(rx0 - sx, 0), c1 = std::min(rx1 - sx, 3);
+                    rasterizeQuad(sx, y, ((1u << (c1 - c0 + 1)) - 1) << c0, inside);
+                }
+            }
+            shadePending();
         }
     }
-    vertices.emplace_back(0, radius, -7);
-    vertices.emplace_back(0, -radius, -7);
+    commitStats();
+}
+
+// Depth-only counterpart of rasterize() for shadow maps: one sample per texel at its center, four texels
+// per iteration, and no attributes, shading, statistics or resolve.
+void rasterizeDepth(ShadowMap& map, const Vec3& v0, const Vec3& v1, const Vec3& v2) {
+    int minX = std::max(0, (int)std::floor(std::min({ v0.x, v1.x, v2.x })));
+    int maxX = std::min(SHADOW_SIZE - 1, (int)std::ceil(std::max({ v0.x, v1.x, v2.x })));
+    int minY = std::max(0, (int)std::floor(std::min({ v0.y, v1.y, v2.y })));
+    int maxY = std::min(SHADOW_SIZE - 1, (int)std::ceil(std::max({ v0.y, v1.y, v2.y })));
 
-    int top = vertices.size() - 2;
-    int bottom = vertices.size() - 1;
+    float denom = (v1.y - v2.y) * (v0.x - v2.x) + (v2.x - v1.x) * (v0.y - v2.y);
+    if (denom == 0 || minX > maxX || minY > maxY) return;
+    const __m128 a0 = _mm_set1_ps((v1.y - v2.y) / denom), b0 = _mm_set1_ps((v2.x - v1.x) / denom);
+    const __m128 a1 = _mm_set1_ps((v2.y - v0.y) / denom), b1 = _mm_set1_ps((v0.x - v2.x) / denom);
+    const __m128 z0 = _mm_set1_ps(v0.z - v2.z), z1 = _mm_set1_ps(v1.z - v2.z), z2 = _mm_set1_ps(v2.z);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), lane = _mm_set_ps(3, 2, 1, 0);
 
+    for (int y = minY; y <= maxY; ++y) {
+        __m128 dy = _mm_set1_ps(y + 0.5f - v2.y);
+        for (int x = minX & ~3; x <= maxX; x += 4) {
+            __m128 dx = _mm_add_ps(_mm_set1_ps(x + 0.5f - v2.x), lane);
+            __m128 w0 = _mm_add_ps(_mm_mul_ps(a0, dx), _mm_mul_ps(b0, dy));
+            __m128 w1 = _mm_add_ps(_mm_mul_ps(a1, dx), _mm_mul_ps(b1, dy));
+            __m128 w2 = _mm_sub_ps(_mm_sub_ps(one, w0), w1);
+            __m128 z = _mm_add_ps(z2, _mm_add_ps(_mm_mul_ps(w0, z0), _mm_mul_ps(w1, z1)));
+            __m128 old = _mm_load_ps(&map.depth[y][x]);
+            __m128 pass = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)),
+                                     _mm_and_ps(_mm_cmpge_ps(w2, zero), _mm_cmplt_ps(z, old)));
+            _mm_store_ps(&map.depth[y][x], select(pass, z, old));
+        }
+    }
+}
+
+// Appends each triangle to the bins of the tiles its screen bounds overlap, in submission order, so
+// every tile sees its triangles in the same order as a serial walk.
+// Counting sort into the tile bins, in two parallel passes over chunks of triangles: the first
+// finds each triangle's tile rectangle and the chunk's count per tile, then a prefix sum over
+// (tile, chunk) gives every chunk its own write cursor per tile, and the second pass scatters.
+// Chunks never share a cursor, and each bin comes out in mesh order.
+struct TileRect {
+    uint16_t x0, y0, x1, y1; // inclusive; empty when culled
+};
+
+void binTriangles(RenderTarget& target, const MeshView& mesh) {
+    const Vec3* screen = target.screenVertices;
+    STATS_COUNT(target, trianglesSubmitted, mesh.triangleCount);
+    size_t chunks = (mesh.triangleCount + TRIANGLES_PER_TASK - 1) / TRIANGLES_PER_TASK;
+    TileRect** rects = target.frameArena.allocate<TileRect*>(chunks);
+    uint32_t** cursors = target.frameArena.allocate<uint32_t*>(chunks);
+    taskPool().parallelFor(0, chunks, 1, [&](size_t begin, size_t end) {
+        STATS_SCOPE(target, STAGE_BIN);
+        FrameArena& scratch = threadArena(target);
+        for (size_t chunk = begin; chunk < end; ++chunk) {
+            size_t first = chunk * TRIANGLES_PER_TASK, last = std::min(mesh.triangleCount, first + TRIANGLES_PER_TASK);
+            TileRect* rect = rects[chunk] = scratch.allocate<TileRect>(last - first);
+            uint32_t* count = cursors[chunk] = scratch.allocate<uint32_t>(TILE_COUNT);
+            std::fill(count, count + TILE_COUNT, 0);
+            for (size_t t = first; t < last; ++t, ++rect) {
+                const Vec3& v0 = screen[mesh.indices[t][0]];
+                const Vec3& v1 = screen[mesh.indices[t][1]];
+                const Vec3& v2 = screen[mesh.indices[t][2]];
+                int minX = std::max(1, (int)std::floor(std::min({ v0.x, v1.x, v2.x })));
+                int maxX = std::min(target.width - 2, (int)std::ceil(std::max({ v0.x, v1.x, v2.x })));
+                int minY = std::max(1, (int)std::floor(std::min({ v0.y, v1.y, v2.y })));
+                int maxY = std::min(target.height - 2, (int)std::ceil(std::max({ v0.y, v1.y, v2.y })));
+                float denom = (v1.y - v2.y) * (v0.x - v2.x) + (v2.x - v1.x) * (v0.y - v2.y);
+                if (denom == 0 || minX > maxX || minY > maxY) {
+                    STATS_COUNT(target, trianglesCulled, 1);
+                    *rect = { 1, 0, 0, 0 };
+                    continue;
+                }
+                STATS_COUNT(target, trianglesRasterized, 1);
+                *rect = { (uint16_t)(minX / TILE_SIZE), (uint16_t)(minY / TILE_SIZE), (uint16_t)(maxX / TILE_SIZE), (uint16_t)(maxY / TILE_SIZE) };
+                for (int ty = rect->y0; ty <= rect->y1; ++ty)
+                    for (int tx = rect->x0; tx <= rect->x1; ++tx) count[ty * TILES_X + tx]++;
+            }
+        }
+    });
+
+    uint32_t* offsets = target.frameArena.allocate<uint32_t>(TILE_COUNT + 1);
+    uint32_t total = 0;
+    for (int tile = 0; tile < TILE_COUNT; ++tile) {
+        offsets[tile] = total;
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            uint32_t count = cursors[chunk][tile];
+            cursors[chunk][tile] = total;
+            total += count;
+        }
+    }
+    offsets[TILE_COUNT] = total;
+
+    uint32_t* binned = target.frameArena.allocate<uint32_t>(total);
+    taskPool().parallelFor(0, chunks, 1, [&](size_t begin, size_t end) {
+        STATS_SCOPE(target, STAGE_BIN);
+        for (size_t chunk = begin; chunk < end; ++chunk) {
+            size_t first = chunk * TRIANGLES_PER_TASK, last = std::min(mesh.triangleCount, first + TRIANGLES_PER_TASK);
+            const TileRect* rect = rects[chunk];
+            uint32_t* cursor = cursors[chunk];
+            for (size_t t = first; t < last; ++t, ++rect)
+                for (int ty = rect->y0; ty <= rect->y1; ++ty)
+                    for (int tx = rect->x0; tx <= rect->x1; ++tx) binned[cursor[ty * TILES_X + tx]++] = (uint32_t)t;
+        }
+    });
+    target.binOffsets = offsets;
+    target.binnedTriangles = binned;
+}
+
+// Runs each non-empty tile bin as a task; drawTriangle(t, tx, ty) rasterizes triangle t within tile (tx, ty).
+template <class DrawTriangle>
+void rasterizeTiles(RenderTarget& target, DrawTriangle&& drawTriangle) {
+    int tilesX = (target.width + TILE_SIZE - 1) / TILE_SIZE, tilesY = (target.height + TILE_SIZE - 1) / TILE_SIZE;
+    taskPool().parallelFor(0, tilesX * tilesY, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int tx = (int)(i % tilesX), ty = (int)(i / tilesX);
+            const uint32_t* bin = target.binnedTriangles + target.binOffsets[ty * TILES_X + tx];
+            const uint32_t* binEnd = target.binnedTriangles + target.binOffsets[ty * TILES_X + tx + 1];
+            if (bin == binEnd) continue;
+            STATS_SCOPE(target, STAGE_RASTER);
+            if (!target.tileCleared[ty][tx]) clearTile(target, tx, ty);
+#if PIPELINE_STATS
+            auto tileStart = debugView == DebugView::TileTime ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+#endif
+            for (; bin != binEnd; ++bin) drawTriangle(*bin, tx, ty);
+#if PIPELINE_STATS
+            if (debugView == DebugView::TileTime)
+                target.tileNs[ty][tx] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tileStart).count();
+#endif
+        }
+    });
+}
+
+void resolveSamples(RenderTarget& target) {
+    const __m128 scale = _mm_set1_ps(1.0f / msaaSamples);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128i alpha = _mm_set1_epi32((int)OPAQUE_ALPHA);
+    taskPool().parallelFor(0, target.height, ROWS_PER_TASK, [&](size_t y0, size_t y1) {
+        STATS_SCOPE(target, STAGE_RESOLVE);
+        alignas(16) float rgb[3][4];
+        alignas(16) uint32_t bytes[3][4];
+        for (int y = (int)y0; y < (int)y1; ++y) {
+            for (int tx = 0; tx * TILE_SIZE < target.width; ++tx) {
+                int x0 = tx * TILE_SIZE, x1 = std::min(target.width, x0 + TILE_SIZE);
+                if (!target.tileCleared[y / TILE_SIZE][tx]) {
+                    if (!target.ppmPixels) // a new mapped PPM is already zero, i.e. background
+                        std::fill(&target.framebuffer[y][x0], &target.framebuffer[y][x1], BACKGROUND_PIXEL);
+                    continue;
+                }
+                for (int x = x0; x < x1; x += 4) {
+                    for (int c = 0; c < 3; ++c) {
+                        __m128 sum = _mm_loadu_ps(&target.colorSamples[0][c][y][x]);
+                        for (int s = 1; s < msaaSamples; ++s)
+                            sum = _mm_add_ps(sum, _mm_loadu_ps(&target.colorSamples[s][c][y][x]));
+                        _mm_store_ps(rgb[c], _mm_min_ps(_mm_max_ps(_mm_mul_ps(sum, scale), zero), one));
+                    }
+                    for (int c = 0; c < 3; ++c)
+                        for (int i = 0; i < 4; ++i) bytes[c][i] = gammaByte(rgb[c][i]);
+                    if (target.ppmPixels) {
+                        // PPM rows run top-down and GL rows bottom-up: flip by addressing.
+                        unsigned char* out = target.ppmPixels + ((size_t)(HEIGHT - 1 - y) * WIDTH + x) * 3;
+                        for (int i = 0; i < 4; ++i) {
+                            out[i * 3] = (unsigned char)bytes[0][i];
+                            out[i * 3 + 1] = (unsigned char)bytes[1][i];
+                            out[i * 3 + 2] = (unsigned char)bytes[2][i];
+                        }
+                        continue;
+                    }
+                    // The four pixels leave in one aligned store.
+                    __m128i r = _mm_load_si128((const __m128i*)bytes[0]);
+                    __m128i g = _mm_load_si128((const __m128i*)bytes[1]);
+                    __m128i b = _mm_load_si128((const __m128i*)bytes[2]);
+                    __m128i px = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), alpha));
+                    _mm_store_si128((__m128i*)&target.framebuffer[y][x], px);
+                }
+            }
+        }
+    });
+}
+
+Vec3 heatRamp(float t) {
+    static const Vec3 stops[6] = { Vec3(0, 0, 0), Vec3(0, 0, 1), Vec3(0, 1, 1), Vec3(0, 1, 0), Vec3(1, 1, 0), Vec3(1, 0, 0) };
+    t = std::clamp(t, 0.0f, 1.0f) * 5.0f;
+    int i = std::min((int)t, 4);
+    float f = t - i;
+    return stops[i] * (1.0f - f) + stops[i + 1] * f;
+}
+
+// Overwrites framebuffer with the active debug view, normalized to the frame's maximum.
+void writeHeatmap(RenderTarget& target) {
+    auto value = [&](int x, int y) {
+        return debugView == DebugView::TileTime ? (double)target.tileNs[y / TILE_SIZE][x / TILE_SIZE] : (double)target.heatCounts[y][x];
+    };
+    double maxValue = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+        for (int x = 0; x < WIDTH; ++x)
+            maxValue = std::max(maxValue, value(x, y));
+    for (int y = 0; y < HEIGHT; ++y)
+        for (int x = 0; x < WIDTH; ++x) {
+            Vec3 c = heatRamp(maxValue > 0 ? (float)(value(x, y) / maxValue) : 0.0f);
+            target.framebuffer[y][x] = packPixel((unsigned)(c.x * 255.0f), (unsigned)(c.y * 255.0f), (unsigned)(c.z * 255.0f));
+        }
+}
+
+// Procedural meshes are sized exactly before anything is written, then filled in parallel straight
+// into their final arrays: one allocation per array and no push_back growth, so multi-million
+// triangle meshes build in milliseconds.
+void resizeMesh(Mesh& mesh, size_t vertexCount, size_t triangleCount) {
+    mesh.vertices.resize(vertexCount);
+    mesh.indices.resize(triangleCount);
+}
+
+// Fills a rows x cols vertex grid starting at firstVertex, vertex (r, c) from vertexAt, and two
+// triangles per cell starting at firstTriangle. A wrapped direction joins its last row or column
+// back to the first rather than duplicating the seam. Work is split by rows.
+template <class VertexFn>
+void fillGrid(Mesh& mesh, size_t firstVertex, size_t firstTriangle, int rows, int cols, bool wrapRows, bool wrapCols,
+              VertexFn vertexAt) {
+    int cellRows = wrapRows ? rows : rows - 1, cellCols = wrapCols ? cols : cols - 1;
+    taskPool().parallelFor(0, rows, ROWS_PER_TASK, [&](size_t begin, size_t end) {
+        for (int r = (int)begin; r < (int)end; ++r) {
+            for (int c = 0; c < cols; ++c) {
+                size_t v = firstVertex + (size_t)r * cols + c;
+                vertexAt(r, c, mesh.vertices[v]);
+            }
+            if (r >= cellRows) continue;
+            int row = (int)firstVertex + r * cols, nextRow = (int)firstVertex + (r + 1) % rows * cols;
+            std::array<int, 3>* tri = &mesh.indices[firstTriangle + (size_t)r * cellCols * 2];
+            for (int c = 0; c < cellCols; ++c) {
+                int next = (c + 1) % cols;
+                *tri++ = { row + c, nextRow + next, nextRow + c };
+                *tri++ = { row + c, row + next, nextRow + next };
+            }
+        }
+    });
+}
+
+// UV sphere: height - 2 rings of width vertices plus the two poles, pole fans first. Every
+// generator winds its triangles the same way, counter-clockwise seen from outside.
+void createSphere(Mesh& mesh, int width = 32, int height = 16, float radius = 2.0f) {
+    int rings = height - 2;
+    int top = rings * width, bottom = top + 1, lastRing = (rings - 1) * width;
+    resizeMesh(mesh, (size_t)rings * width + 2, (size_t)(rings - 1) * width * 2 + width * 2);
+    mesh.vertices[top] = Vec3(0, radius, 0);
+    mesh.vertices[bottom] = Vec3(0, -radius, 0);
     for (int i = 0; i < width; ++i) {
-        indices.push_back({ top, i, (i + 1) % width });
-        indices.push_back({ bottom, (height - 3) * width + (i + 1) % width, (height - 3) * width + i });
+        mesh.indices[2 * i] = { top, (i + 1) % width, i };
+        mesh.indices[2 * i + 1] = { bottom, lastRing + i, lastRing + (i + 1) % width };
     }
+    fillGrid(mesh, 0, width * 2, rings, width, false, true, [=](int r, int c, Vec3& p) {
+        float theta = M_PI * (r + 1) / (height - 1);
+        float phi = 2 * M_PI * c / width + M_PI;
+        p = Vec3(-radius * sinf(theta) * cosf(phi), radius * cosf(theta), -radius * sinf(theta) * sinf(phi));
+    });
+}
 
-    for (int j = 0; j < height - 3; ++j) {
-        for (int i = 0; i < width; ++i) {
-            int idx = j * width + i;
-            int next = (i + 1) % width;
-            indices.push_back({ idx, (j + 1) * width + next, (j + 1) * width + i });
-            indices.push_back({ idx, j * width + next, (j + 1) * width + next });
+// Torus in the xy plane, facing the default camera: rings segments along the main circle, sides
+// around the tube.
+void createTorus(Mesh& mesh, int rings = 48, int sides = 24, float majorRadius = 1.5f, float minorRadius = 0.6f) {
+    resizeMesh(mesh, (size_t)rings * sides, (size_t)rings * sides * 2);
+    fillGrid(mesh, 0, 0, rings, sides, true, true, [=](int r, int c, Vec3& p) {
+        float u = 2 * M_PI * r / rings, v = 2 * M_PI * c / sides;
+        Vec3 tube(cosf(v) * cosf(u), cosf(v) * sinf(u), -sinf(v));
+        p = Vec3(majorRadius * cosf(u), majorRadius * sinf(u), 0) + tube * minorRadius;
+    });
+}
+
+// Capped cylinder along the y axis. The cap rims repeat the side's end rings so the caps keep flat
+// normals: each cap is a center vertex followed by its rim.
+void createCylinder(Mesh& mesh, int segments = 32, int rings = 1, float radius = 1.5f, float height = 3.0f) {
+    size_t side = (size_t)(rings + 1) * segments, sideTriangles = (size_t)rings * segments * 2;
+    resizeMesh(mesh, side + 2 * (segments + 1), sideTriangles + 2 * segments);
+    fillGrid(mesh, 0, 0, rings + 1, segments, false, true, [=](int r, int c, Vec3& p) {
+        float phi = 2 * M_PI * c / segments;
+        p = Vec3(radius * cosf(phi), height * (0.5f - (float)r / rings), radius * sinf(phi));
+    });
+    for (int cap = 0; cap < 2; ++cap) {
+        int center = (int)side + cap * (segments + 1);
+        float y = cap == 0 ? height / 2 : -height / 2;
+        const Vec3* rim = &mesh.vertices[cap == 0 ? 0 : (size_t)rings * segments];
+        mesh.vertices[center] = Vec3(0, y, 0);
+        for (int i = 0; i < segments; ++i) mesh.vertices[center + 1 + i] = rim[i];
+        std::array<int, 3>* tri = &mesh.indices[sideTriangles + (size_t)cap * segments];
+        for (int i = 0; i < segments; ++i) {
+            int a = center + 1 + i, b = center + 1 + (i + 1) % segments;
+            tri[i] = cap == 0 ? std::array<int, 3>{ center, b, a } : std::array<int, 3>{ center, a, b };
         }
     }
 }
 
-Vec3 computeFlatColor(const Vec3& v0, const Vec3& v1, const Vec3& v2) {
-    Vec3 centroid = (v0 + v1 + v2) * (1.0f / 3.0f);
-    Vec3 N = (v1 - v0).cross(v2 - v0).normalize();
-    if (N.dot(Vec3(0, 0, -1)) > 0) N = N * -1;
-    Vec3 light = Vec3(-4, 4, -3);
-    Vec3 rotatedLight = Vec3(-light.x, -light.y, light.z);
-    Vec3 L = (rotatedLight - centroid).normalize();
+// Square grid of cols x rows cells in the xy plane, facing +z (toward the default camera).
+void createGrid(Mesh& mesh, int cols = 16, int rows = 16, float size = 4.0f) {
+    resizeMesh(mesh, (size_t)(rows + 1) * (cols + 1), (size_t)rows * cols * 2);
+    fillGrid(mesh, 0, 0, rows + 1, cols + 1, false, false, [=](int r, int c, Vec3& p) {
+        p = Vec3(size * ((float)c / cols - 0.5f), size * ((float)r / rows - 0.5f), 0);
+    });
+}
 
-    Vec3 V = Vec3(0, 0, 0) - centroid;
-    V = V.normalize();
-    Vec3 R = N * (2 * N.dot(L)) - L;
+// Geodesic sphere: an icosahedron whose faces are split into four `subdivisions` times, each new
+// vertex pushed out to the sphere. Triangles stay close to equilateral, so there are no pole slivers;
+// edge midpoints are cached so neighbouring faces share vertices. Level n has 20 * 4^n triangles
+// and 10 * 4^n + 2 vertices.
+void createIcosphere(Mesh& mesh, int subdivisions = 2, float radius = 2.0f) {
+    auto& vertices = mesh.vertices;
+    auto& indices = mesh.indices;
+    const float t = (1 + std::sqrt(5.0f)) / 2;
+    const Vec3 corners[12] = { Vec3(-1, t, 0), Vec3(1, t, 0), Vec3(-1, -t, 0), Vec3(1, -t, 0), Vec3(0, -1, t), Vec3(0, 1, t),
+                               Vec3(0, -1, -t), Vec3(0, 1, -t), Vec3(t, 0, -1), Vec3(t, 0, 1), Vec3(-t, 0, -1), Vec3(-t, 0, 1) };
+    vertices.clear();
+    vertices.reserve(10 * ((size_t)1 << 2 * subdivisions) + 2);
+    for (const Vec3& c : corners) vertices.push_back(c.normalize() * radius);
+    indices = { { 0, 11, 5 }, { 0, 5, 1 }, { 0, 1, 7 }, { 0, 7, 10 }, { 0, 10, 11 }, { 1, 5, 9 }, { 5, 11, 4 },
+                { 11, 10, 2 }, { 10, 7, 6 }, { 7, 1, 8 }, { 3, 9, 4 }, { 3, 4, 2 }, { 3, 2, 6 }, { 3, 6, 8 },
+                { 3, 8, 9 }, { 4, 9, 5 }, { 2, 4, 11 }, { 6, 2, 10 }, { 8, 6, 7 }, { 9, 8, 1 } };
 
-    float Ia = 0.2f;
-    Vec3 ka(0, 1, 0), kd(0, 0.5, 0), ks(0.5, 0.5, 0.5);
-    float diffuse = std::max(0.0f, N.dot(L));
-    float specular = std::pow(std::max(0.0f, R.dot(V)), 32.0f);
-    return ka * Ia + kd * diffuse + ks * specular;
+    std::unordered_map<uint64_t, int> midpoints;
+    auto midpoint = [&](int a, int b) {
+        uint64_t key = (uint64_t)std::min(a, b) << 32 | (uint32_t)std::max(a, b);
+        auto found = midpoints.emplace(key, (int)vertices.size());
+        if (found.second) vertices.push_back(((vertices[a] + vertices[b]) * 0.5f).normalize() * radius);
+        return found.first->second;
+    };
+    for (int level = 0; level < subdivisions; ++level) {
+        std::vector<std::array<int, 3>> split;
+        split.reserve(indices.size() * 4);
+        midpoints.clear();
+        for (const auto& tri : indices) {
+            int a = midpoint(tri[0], tri[1]), b = midpoint(tri[1], tri[2]), c = midpoint(tri[2], tri[0]);
+            split.push_back({ tri[0], a, c });
+            split.push_back({ tri[1], b, a });
+            split.push_back({ tri[2], c, b });
+            split.push_back({ a, b, c });
+        }
+        indices.swap(split);
+    }
 }
 
-void rasterizeTriangle(Vec3 v0, Vec3 v1, Vec3 v2, const Vec3& color) {
-    applyTransform(v0);
-    applyTransform(v1);
-    applyTransform(v2);
+enum class LightModel { Ambient, Lambert, Phong };
 
-    int minX = std::max(1, (int)std::floor(std::min({ v0.x, v1.x, v2.x })));
-    int maxX = std::min(WIDTH - 2, (int)std::ceil(std::max({ v0.x, v1.x, v2.x })));
-    int minY = std::max(1, (int)std::floor(std::min({ v0.y, v1.y, v2.y })));
-    int maxY = std::min(HEIGHT - 2, (int)std::ceil(std::max({ v0.y, v1.y, v2.y })));
+struct Material {
+    const char* name;
+    LightModel model;
+    Vec3 ka, kd, ks;
+    float Ia;
+    int shininess;
+};
 
-    for (int y = minY; y <= maxY; ++y) {
-        for (int x = minX; x <= maxX; ++x) {
-            float denom = (v1.y - v2.y) * (v0.x - v2.x) + (v2.x - v1.x) * (v0.y - v2.y);
-            float w0 = ((v1.y - v2.y) * (x - v2.x) + (v2.x - v1.x) * (y - v2.y)) / denom;
-            float w1 = ((v2.y - v0.y) * (x - v2.x) + (v0.x - v2.x) * (y - v2.y)) / denom;
-            float w2 = 1.0f - w0 - w1;
-            if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-                float z = w0 * v0.z + w1 * v1.z + w2 * v2.z;
-                if (z < zbuffer[y][x]) {
-                    zbuffer[y][x] = z;
-                    setPixel(x, y, color);
-                }
+// Per-draw constants, resolved once from the material and light before rasterization.
+struct ShadeParams {
+    Vec3 ambient;
+    Vec3 kd, ks;
+    float shininess;
+    Vec3 lightPos, eyePos; // in the object space of the mesh being drawn
+    const ShadowMap* shadow = nullptr; // scales diffuse and specular when set
+};
+
+ShadeParams makeShadeParams(const Material& m, const Vec3& lightPosition, const Vec3& eyePosition) {
+    ShadeParams p;
+    p.ambient = m.ka * m.Ia;
+    p.kd = m.kd;
+    p.ks = m.ks;
+    p.shininess = (float)m.shininess;
+    p.lightPos = lightPosition;
+    p.eyePos = eyePosition;
+    return p;
+}
+
+template <int N>
+constexpr float powi(float x) {
+    if constexpr (N == 0) return 1.0f;
+    else if constexpr (N % 2 == 0) { float h = powi<N / 2>(x); return h * h; }
+    else return x * powi<N - 1>(x);
+}
+
+template <int N>
+__m128 powi(__m128 x) {
+    if constexpr (N == 0) return _mm_set1_ps(1.0f);
+    else if constexpr (N % 2 == 0) { __m128 h = powi<N / 2>(x); return _mm_mul_ps(h, h); }
+    else return _mm_mul_ps(x, powi<N - 1>(x));
+}
+
+__m128 powLanes(__m128 x, float e) {
+    alignas(16) float s[4];
+    _mm_store_ps(s, x);
+    for (float& v : s) v = std::pow(v, e);
+    return _mm_load_ps(s);
+}
+
+// Shininess == 0 falls back to std::pow with the runtime exponent from ShadeParams.
+// N is expected to be unit length. The Vec3x4 overload shades four points at once.
+template <bool Diffuse, bool Specular, int Shininess>
+struct LightingKernel {
+    static Vec3 shade(const ShadeParams& p, const Vec3& pos, const Vec3& N) {
+        Vec3 color = p.ambient;
+        if constexpr (Diffuse || Specular) {
+            float visible = p.shadow ? p.shadow->visibility(pos, N) : 1.0f;
+            if (visible == 0) return color;
+            Vec3 L = (p.lightPos - pos).normalize();
+            Vec3 lit;
+            if constexpr (Diffuse)
+                lit += p.kd * std::max(0.0f, N.dot(L));
+            if constexpr (Specular) {
+                Vec3 V = (p.eyePos - pos).normalize();
+                Vec3 R = N * (2.0f * N.dot(L)) - L;
+                float s = std::max(0.0f, R.dot(V));
+                if constexpr (Shininess > 0) lit += p.ks * powi<Shininess>(s);
+                else lit += p.ks * std::pow(s, p.shininess);
+            }
+            color += lit * visible;
+        }
+        return color;
+    }
+
+    static Vec3x4 shade(const ShadeParams& p, const Vec3x4& pos, const Vec3x4& N) {
+        Vec3x4 color(p.ambient);
+        if constexpr (Diffuse || Specular) {
+            const __m128 zero = _mm_setzero_ps();
+            Vec3x4 L = (Vec3x4(p.lightPos) - pos).normalize();
+            __m128 NdotL = N.dot(L);
+            Vec3x4 lit(zero, zero, zero);
+            if constexpr (Diffuse)
+                lit += Vec3x4(p.kd) * _mm_max_ps(zero, NdotL);
+            if constexpr (Specular) {
+                Vec3x4 V = (Vec3x4(p.eyePos) - pos).normalize();
+                Vec3x4 R = (N * _mm_add_ps(NdotL, NdotL) - L);
+                __m128 s = _mm_max_ps(zero, R.dot(V));
+                if constexpr (Shininess > 0) lit += Vec3x4(p.ks) * powi<Shininess>(s);
+                else lit += Vec3x4(p.ks) * powLanes(s, (float)p.shininess);
             }
+            color += p.shadow ? lit * p.shadow->visibility(pos, N) : lit;
+        }
+        return color;
+    }
+};
+
+// Shades four faces at once; normals are flipped to face the eye.
+template <class Kernel>
+Vec3x4 computeFlatColor(const ShadeParams& params, const Vec3x4& v0, const Vec3x4& v1, const Vec3x4& v2) {
+    Vec3x4 centroid = (v0 + v1 + v2) * _mm_set1_ps(1.0f / 3.0f);
+    Vec3x4 N = (v1 - v0).cross(v2 - v0).normalize();
+    N = select(_mm_cmplt_ps(N.dot(Vec3x4(params.eyePos) - centroid), _mm_setzero_ps()), N * _mm_set1_ps(-1.0f), N);
+    return Kernel::shade(params, centroid, N);
+}
+
+// v0..v2 are in screen space.
+void rasterizeTriangle(RenderTarget& target, int tx, int ty, const Vec3& v0, const Vec3& v1, const Vec3& v2, const Vec3& color) {
+    rasterize(target, tx, ty, v0, v1, v2, [&](float, float, float) { return color; });
+}
+
+// A procedural mesh, as named by --mesh or a batch job's mesh= key:
+//   sphere:WxH  ico:N  torus:RINGSxSIDES  cylinder:SEGMENTSxRINGS  grid:COLSxROWS  plane
+enum class MeshShape { Sphere, Icosphere, Torus, Cylinder, Grid };
+struct MeshSpec {
+    MeshShape shape = MeshShape::Sphere;
+    int a = 32, b = 16;
+};
+
+bool parseMeshSpec(const std::string& text, MeshSpec& result) {
+    MeshSpec spec;
+    std::string name = text.substr(0, text.find(':'));
+    const char* args = text.size() > name.size() ? text.c_str() + name.size() + 1 : "";
+    if (name == "plane") spec = { MeshShape::Grid, 1, 1 };
+    else if (name == "ico") spec = { MeshShape::Icosphere, 2, 0 };
+    else if (name == "sphere") spec = { MeshShape::Sphere, 32, 16 };
+    else if (name == "torus") spec = { MeshShape::Torus, 48, 24 };
+    else if (name == "cylinder") spec = { MeshShape::Cylinder, 32, 1 };
+    else if (name == "grid") spec = { MeshShape::Grid, 16, 16 };
+    else return false;
+    if (name == "plane") {
+        if (*args) return false;
+    } else if (name == "ico") {
+        if ((*args && std::sscanf(args, "%d", &spec.a) != 1) || spec.a < 0 || spec.a > 8) return false;
+    } else {
+        if (*args && std::sscanf(args, "%dx%d", &spec.a, &spec.b) != 2) return false;
+        int minA = spec.shape == MeshShape::Grid ? 1 : 3;
+        int minB = spec.shape == MeshShape::Sphere ? 4 : spec.shape == MeshShape::Torus ? 3 : 1;
+        // Vertex indices are int.
+        if (spec.a < minA || spec.b < minB || (double)(spec.a + 1) * (spec.b + 1) >= std::numeric_limits<int>::max()) return false;
+    }
+    result = spec;
+    return true;
+}
+
+void buildMesh(Mesh& mesh, const MeshSpec& spec) {
+    switch (spec.shape) {
+    case MeshShape::Sphere: createSphere(mesh, spec.a, spec.b); break;
+    case MeshShape::Icosphere: createIcosphere(mesh, spec.a); break;
+    case MeshShape::Torus: createTorus(mesh, spec.a, spec.b); break;
+    case MeshShape::Cylinder: createCylinder(mesh, spec.a, spec.b); break;
+    case MeshShape::Grid: createGrid(mesh, spec.a, spec.b); break;
+    }
+}
+
+// Compact vertex format: positions quantized to 16 bits per axis within the mesh bounds,
+// 6 bytes per vertex instead of 12.
+struct CompactMesh {
+    Vec3 boundsMin, boundsStep; // position = boundsMin + q * boundsStep
+    std::vector<uint16_t> qx, qy, qz;
+    std::vector<std::array<int, 3>> indices;
+};
+
+CompactMesh compressMesh(const Mesh& mesh) {
+    CompactMesh c;
+    const float inf = std::numeric_limits<float>::infinity();
+    Vec3 lo(inf, inf, inf), hi(-inf, -inf, -inf);
+    for (const Vec3& p : mesh.vertices) {
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    Vec3 extent = hi - lo;
+    c.boundsMin = lo;
+    c.boundsStep = Vec3(extent.x / 65535.0f, extent.y / 65535.0f, extent.z / 65535.0f);
+    auto quantize = [](float v, float base, float step) { return (uint16_t)(step > 0 ? std::lround((v - base) / step) : 0); };
+
+    size_t n = mesh.vertices.size();
+    c.qx.resize(n); c.qy.resize(n); c.qz.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        const Vec3& p = mesh.vertices[i];
+        c.qx[i] = quantize(p.x, lo.x, c.boundsStep.x);
+        c.qy[i] = quantize(p.y, lo.y, c.boundsStep.y);
+        c.qz[i] = quantize(p.z, lo.z, c.boundsStep.z);
+    }
+    c.indices = mesh.indices;
+    return c;
+}
+
+MeshView viewOf(const CompactMesh& c) {
+    return { nullptr, c.qx.size(), c.indices.data(), c.indices.size(), &c };
+}
+
+// Vertex i of a view. Compact vertices are decoded on every read, here one at a time for stages that
+// visit vertices through triangles, and four at a time by loadPositions() in the vertex stage, so no
+// decoded copy of the mesh is ever written or read back.
+inline Vec3 positionAt(const MeshView& mesh, size_t i) {
+    if (!mesh.compact) return mesh.vertices[i];
+    const CompactMesh& c = *mesh.compact;
+    return c.boundsMin + Vec3(c.qx[i] * c.boundsStep.x, c.qy[i] * c.boundsStep.y, c.qz[i] * c.boundsStep.z);
+}
+
+// Vertices i .. i + count - 1, with unused lanes as in loadVec3x4(). Whole groups of compact vertices
+// decode in SIMD with the same operations as positionAt(), so both give the same bits.
+Vec3x4 loadPositions(const MeshView& mesh, size_t i, size_t count = 4) {
+    if (!mesh.compact) return loadVec3x4(mesh.vertices + i, count);
+    if (count < 4) {
+        Vec3 p[4];
+        for (size_t k = 0; k < 4; ++k) p[k] = positionAt(mesh, i + (k < count ? k : 0));
+        return loadVec3x4(p);
+    }
+    const CompactMesh& c = *mesh.compact;
+    auto axis = [i](const std::vector<uint16_t>& q, float base, float step) {
+        __m128 f = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)&q[i]), _mm_setzero_si128()));
+        return _mm_add_ps(_mm_set1_ps(base), _mm_mul_ps(f, _mm_set1_ps(step)));
+    };
+    return Vec3x4(axis(c.qx, c.boundsMin.x, c.boundsStep.x), axis(c.qy, c.boundsMin.y, c.boundsStep.y),
+                  axis(c.qz, c.boundsMin.z, c.boundsStep.z));
+}
+
+// gatherVec3x4() over a view's positions.
+Vec3x4 gatherPositions(const MeshView& mesh, const int* idx, size_t count = 4) {
+    if (!mesh.compact) return gatherVec3x4(mesh.vertices, idx, count);
+    Vec3 p[4];
+    for (size_t k = 0; k < 4; ++k) p[k] = positionAt(mesh, idx[k < count ? k : 0]);
+    return loadVec3x4(p);
+}
+
+// Aims a light frustum from lightPos at the mesh's bounding sphere and renders its depth.
+void renderShadowMap(ShadowMap& map, const MeshView& mesh, const Vec3& lightPos) {
+    const float inf = std::numeric_limits<float>::infinity();
+    std::fill(&map.depth[0][0], &map.depth[0][0] + SHADOW_SIZE * SHADOW_SIZE, inf);
+    if (mesh.vertexCount == 0) return;
+
+    Vec3 lo(inf, inf, inf), hi(-inf, -inf, -inf);
+    for (size_t i = 0; i < mesh.vertexCount; ++i) {
+        Vec3 p = positionAt(mesh, i);
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    Vec3 center = (lo + hi) * 0.5f;
+    float radius = std::sqrt((hi - center).dot(hi - center));
+    Vec3 toCenter = center - lightPos;
+    float dist = std::sqrt(toCenter.dot(toCenter));
+
+    map.origin = lightPos;
+    map.forward = dist > 0 ? toCenter * (1.0f / dist) : Vec3(0, 0, -1);
+    Vec3 upHint = std::fabs(map.forward.y) < 0.99f ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+    map.right = map.forward.cross(upHint).normalize();
+    map.up = map.right.cross(map.forward);
+    float tanHalf = dist > radius * 1.01f ? radius / std::sqrt(dist * dist - radius * radius) : 1.0f;
+    map.scale = SHADOW_SIZE * 0.5f / tanHalf;
+
+    for (size_t t = 0; t < mesh.triangleCount; ++t) {
+        const auto& tri = mesh.indices[t];
+        Vec3 v[3];
+        bool behind = false;
+        for (int c = 0; c < 3; ++c) {
+            v[c] = map.project(positionAt(mesh, tri[c]));
+            behind |= v[c].z <= 0;
+            v[c].z = -1.0f / v[c].z;
+        }
+        if (!behind) rasterizeDepth(map, v[0], v[1], v[2]);
+    }
+}
+
+template <class Kernel>
+void drawMesh(RenderTarget& target, const MeshView& mesh, const Mat4& mvp, const ShadeParams& params) {
+    TaskPool& pool = taskPool();
+    STATS_STAGE(target, STAGE_VERTEX);
+    target.screenVertices = target.frameArena.allocate<Vec3>(mesh.vertexCount);
+    target.faceColors = target.frameArena.allocate<Vec3>(mesh.triangleCount);
+
+    // Face colors are only needed by the raster stage, so they overlap the transform and binning.
+    TaskGroup transformed, shaded, binned;
+    // Compact meshes are decoded here and in the face-color tasks, each reading the vertices it uses.
+    pool.parallelFor(0, mesh.vertexCount, VERTICES_PER_TASK, [&target, &mesh, &mvp](size_t begin, size_t end) {
+        STATS_SCOPE(target, STAGE_VERTEX);
+        for (size_t i = begin; i < end; i += 4) {
+            size_t count = std::min<size_t>(4, end - i);
+            Vec3x4 v = loadPositions(mesh, i, count);
+            applyTransform(v, mvp, (float)target.width, (float)target.height);
+            storeVec3x4(&target.screenVertices[i], v, count);
         }
+    }, transformed);
+    pool.parallelFor(0, mesh.triangleCount, VERTICES_PER_TASK, [&target, &mesh, &params](size_t begin, size_t end) {
+        STATS_SCOPE(target, STAGE_VERTEX);
+        for (size_t t = begin; t < end; t += 4) {
+            size_t count = std::min<size_t>(4, end - t);
+            int idx[3][4];
+            for (size_t k = 0; k < count; ++k)
+                for (int c = 0; c < 3; ++c) idx[c][k] = mesh.indices[t + k][c];
+            Vec3x4 v0 = gatherPositions(mesh, idx[0], count);
+            Vec3x4 v1 = gatherPositions(mesh, idx[1], count);
+            Vec3x4 v2 = gatherPositions(mesh, idx[2], count);
+            storeVec3x4(&target.faceColors[t], computeFlatColor<Kernel>(params, v0, v1, v2), count);
+        }
+    }, shaded);
+    pool.submit([&target, &mesh] {
+        STATS_SCOPE(target, STAGE_BIN);
+        binTriangles(target, mesh);
+    }, binned, &transformed);
+    pool.wait(transformed);
+    pool.wait(shaded);
+    pool.wait(binned);
+
+    STATS_STAGE(target, STAGE_RASTER);
+    const Vec3* screen = target.screenVertices;
+    rasterizeTiles(target, [&](uint32_t t, int tx, int ty) {
+        const auto& tri = mesh.indices[t];
+        rasterizeTriangle(target, tx, ty, screen[tri[0]], screen[tri[1]], screen[tri[2]], target.faceColors[t]);
+    });
+}
+
+using DrawFn = void (*)(RenderTarget&, const MeshView&, const Mat4& mvp, const ShadeParams&);
+
+template <bool Diffuse>
+DrawFn selectSpecularVariant(int shininess) {
+    switch (shininess) {
+    case 1: return drawMesh<LightingKernel<Diffuse, true, 1>>;
+    case 2: return drawMesh<LightingKernel<Diffuse, true, 2>>;
+    case 4: return drawMesh<LightingKernel<Diffuse, true, 4>>;
+    case 8: return drawMesh<LightingKernel<Diffuse, true, 8>>;
+    case 16: return drawMesh<LightingKernel<Diffuse, true, 16>>;
+    case 32: return drawMesh<LightingKernel<Diffuse, true, 32>>;
+    case 64: return drawMesh<LightingKernel<Diffuse, true, 64>>;
+    case 128: return drawMesh<LightingKernel<Diffuse, true, 128>>;
+    default: return drawMesh<LightingKernel<Diffuse, true, 0>>;
     }
 }
 
-void render() {
-    clearBuffers();
-    for (const auto& tri : indices) {
-        Vec3 v0 = vertices[tri[0]];
-        Vec3 v1 = vertices[tri[1]];
-        Vec3 v2 = vertices[tri[2]];
-        Vec3 color = computeFlatColor(v0, v1, v2);
-        rasterizeTriangle(v0, v1, v2, color);
+bool isZero(const Vec3& v) { return v.x == 0 && v.y == 0 && v.z == 0; }
+
+DrawFn selectDrawFn(const Material& m) {
+    bool diffuse = m.model != LightModel::Ambient && !isZero(m.kd);
+    bool specular = m.model == LightModel::Phong && !isZero(m.ks) && m.shininess > 0;
+    if (specular)
+        return diffuse ? selectSpecularVariant<true>(m.shininess) : selectSpecularVariant<false>(m.shininess);
+    return diffuse ? drawMesh<LightingKernel<true, false, 0>> : drawMesh<LightingKernel<false, false, 0>>;
+}
+
+struct MaterialEntry {
+    Material material;
+    DrawFn draw;
+};
+
+std::vector<MaterialEntry> materialRegistry;
+
+int registerMaterial(const Material& m) {
+    materialRegistry.push_back({ m, selectDrawFn(m) });
+    return (int)materialRegistry.size() - 1;
+}
+
+void registerDefaultMaterials() {
+    registerMaterial({ "green plastic", LightModel::Phong, Vec3(0, 1, 0), Vec3(0, 0.5f, 0), Vec3(0.5f, 0.5f, 0.5f), 0.2f, 32 });
+    registerMaterial({ "green matte", LightModel::Lambert, Vec3(0, 1, 0), Vec3(0, 0.5f, 0), Vec3(), 0.2f, 0 });
+    registerMaterial({ "polished steel", LightModel::Phong, Vec3(0.6f, 0.6f, 0.65f), Vec3(0.4f, 0.4f, 0.45f), Vec3(0.9f, 0.9f, 0.9f), 0.2f, 128 });
+}
+
+// Draws compactMesh when set, otherwise mesh.
+struct Scene {
+    const Mesh* mesh;
+    const CompactMesh* compactMesh;
+    int material;
+    Vec3 lightPosition; // world space
+    bool shadows;
+    // Both rigid (rotation and translation): lighting runs in object space, and moving the camera or
+    // the object only changes the matrices.
+    Mat4 model, view;
+};
+
+Mesh sphereMesh;
+CompactMesh compactSphereMesh;
+bool useCompactMesh = false;
+MeshSpec sceneMesh; // --mesh, --icosphere
+const Vec3 spherePosition(0, 0, -7);
+const Mat4 sphereModel = Mat4::translation(spherePosition);
+Scene scene = { &sphereMesh, nullptr, 0, Vec3(-4, 4, -3), false, sphereModel, Mat4() };
+
+void render(RenderTarget& target, const Scene& scene) {
+    resetPipelineStats(target);
+    STATS_STAGE(target, STAGE_CLEAR);
+    clearBuffers(target);
+    STATS_STAGE(target, STAGE_VERTEX);
+    MeshView mesh = scene.compactMesh ? viewOf(*scene.compactMesh) : viewOf(*scene.mesh);
+    const MaterialEntry& entry = materialRegistry[scene.material];
+    Mat4 modelView = scene.view * scene.model;
+    ShadeParams params = makeShadeParams(entry.material, scene.model.inverseRigid().transformPoint(scene.lightPosition),
+        modelView.inverseRigid().transformPoint(Vec3(0, 0, 0)));
+    if (scene.shadows) {
+        STATS_STAGE(target, STAGE_SHADOW);
+        renderShadowMap(target.shadowMap, mesh, params.lightPos);
+        params.shadow = &target.shadowMap;
     }
+    entry.draw(target, mesh, projection * modelView, params);
+    STATS_STAGE(target, STAGE_RESOLVE);
+    resolveSamples(target);
+    STATS_STAGE(target, STAGE_COUNT);
+    mergePipelineStats(target);
+    target.frameArena.reset();
+    for (FrameArena& arena : target.threadArenas) arena.reset();
+    if (debugView != DebugView::None)
+        writeHeatmap(target);
+}
+
+// Lock-free triple-buffer handoff. readyBuffer holds the index of the latest completed frame,
+// tagged with FRESH_FRAME until the presenter takes it.
+alignas(16) uint32_t frameBuffers[3][HEIGHT][WIDTH];
+const unsigned FRESH_FRAME = 4;
+std::atomic<unsigned> readyBuffer{ 1 };
+unsigned writeBuffer = 0;
+unsigned presentBuffer = 2;
+PipelineStats frameStats[3];
+int frameSizes[3][2] = { { WIDTH, HEIGHT }, { WIDTH, HEIGHT }, { WIDTH, HEIGHT } }; // rendered width and height
+std::unique_ptr<RenderTarget> mainTarget;
+
+// Render thread: hand the finished buffer to the presenter and take back the stale one.
+void publishFrame(RenderTarget& target) {
+    frameStats[writeBuffer] = target.stats;
+    frameSizes[writeBuffer][0] = target.width;
+    frameSizes[writeBuffer][1] = target.height;
+    writeBuffer = readyBuffer.exchange(writeBuffer | FRESH_FRAME, std::memory_order_acq_rel) & ~FRESH_FRAME;
+    target.framebuffer = frameBuffers[writeBuffer];
+}
+
+// Present thread: swap in the latest completed frame, if there is one it hasn't shown yet.
+bool acquireFrame() {
+    if (!(readyBuffer.load(std::memory_order_acquire) & FRESH_FRAME)) return false;
+    presentBuffer = readyBuffer.exchange(presentBuffer, std::memory_order_acq_rel) & ~FRESH_FRAME;
+    return true;
+}
+
+std::thread renderThread;
+bool renderThreadRunning = false;
+bool continuousRendering = false;
+int pendingFrames = 0;
+bool renderingFrame = false; // the render thread has taken a request and not yet gone back to wait
+std::mutex renderThreadMutex; // also guards `scene` while the window is open
+std::condition_variable renderThreadWake;
+
+// Dynamic resolution: the window's render target shrinks until a frame takes about targetFrameMs,
+// and display() stretches it back to the window.
+float targetFrameMs = 0; // --frame-ms; 0 always renders at full resolution
+float resolutionScale = 1;
+const float MIN_RESOLUTION_SCALE = 0.25f;
+
+void updateResolution(RenderTarget& target, double frameMs) {
+    if (targetFrameMs <= 0) return;
+    // Frame time is roughly proportional to pixel count, i.e. to the square of the scale. Move halfway
+    // to the estimate each frame so one slow frame does not make the image jump.
+    float estimate = resolutionScale * (float)std::sqrt(targetFrameMs / std::max(frameMs, 0.01));
+    resolutionScale = std::clamp(resolutionScale + 0.5f * (estimate - resolutionScale), MIN_RESOLUTION_SCALE, 1.0f);
+    target.width = std::max(4, (int)(WIDTH * resolutionScale) & ~3);
+    target.height = std::max(4, (int)(HEIGHT * resolutionScale));
+}
+
+void renderLoop() {
+    for (;;) {
+        Scene frameScene;
+        {
+            std::unique_lock<std::mutex> lock(renderThreadMutex);
+            renderingFrame = false;
+            renderThreadWake.wait(lock, [] { return pendingFrames > 0 || continuousRendering || !renderThreadRunning; });
+            if (!renderThreadRunning) return;
+            pendingFrames = 0;
+            renderingFrame = true;
+            frameScene = scene;
+        }
+        auto start = std::chrono::steady_clock::now();
+        render(*mainTarget, frameScene);
+        publishFrame(*mainTarget);
+        updateResolution(*mainTarget, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+void requestFrame() {
+    {
+        std::lock_guard<std::mutex> lock(renderThreadMutex);
+        ++pendingFrames;
+    }
+    renderThreadWake.notify_one();
+}
+
+void startRenderThread() {
+    if (!mainTarget) mainTarget.reset(new RenderTarget);
+    mainTarget->framebuffer = frameBuffers[writeBuffer];
+    renderThreadRunning = true;
+    renderThread = std::thread(renderLoop);
+}
+
+void stopRenderThread() {
+    {
+        std::lock_guard<std::mutex> lock(renderThreadMutex);
+        renderThreadRunning = false;
+    }
+    renderThreadWake.notify_one();
+    if (renderThread.joinable()) renderThread.join();
 }
 
 void display() {
-    render();
+    auto presentStart = std::chrono::steady_clock::now();
+    bool fresh = acquireFrame();
+    int w = frameSizes[presentBuffer][0], h = frameSizes[presentBuffer][1];
     glClear(GL_COLOR_BUFFER_BIT);
-    glDrawPixels(WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, framebuffer);
+    glPixelZoom((float)WIDTH / w, (float)HEIGHT / h);
+    glDrawPixels(w, h, GL_RGBA, GL_UNSIGNED_BYTE, frameBuffers[presentBuffer]);
     glutSwapBuffers();
+    frameStats[presentBuffer].stageNs[STAGE_PRESENT] =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - presentStart).count();
+    if (fresh && statsPath) {
+        std::ofstream out(statsPath);
+        writePipelineStatsJson(out, frameStats[presentBuffer]);
+        out << "\n";
+    }
+}
+
+// The idle callback polls for published frames. It is registered only while a frame is requested or
+// being rendered, or for good under --continuous, so an unchanged window does not wake every 1 ms.
+bool idleRegistered = false;
+
+void idle() {
+    bool busy;
+    {
+        std::lock_guard<std::mutex> lock(renderThreadMutex);
+        busy = pendingFrames > 0 || renderingFrame || continuousRendering;
+    }
+    // Read after `busy`: a frame published before the render thread went idle is seen here.
+    if (readyBuffer.load(std::memory_order_acquire) & FRESH_FRAME) {
+        glutPostRedisplay();
+    } else if (!busy) {
+        glutIdleFunc(nullptr);
+        idleRegistered = false;
+    } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// requestFrame() for the window: also makes sure idle() is watching for the result.
+void requestWindowFrame() {
+    requestFrame();
+    if (!idleRegistered) {
+        glutIdleFunc(idle);
+        idleRegistered = true;
+    }
+}
+
+// Orbit controls: drag with the left button or use the arrow keys to circle spherePosition, scroll or
+// +/- to zoom, r to reset.
+struct OrbitCamera {
+    float yaw = 0, pitch = 0, distance = 7;
+
+    Mat4 view() const {
+        return Mat4::translation(Vec3(0, 0, -distance)) * Mat4::rotation(Vec3(1, 0, 0), pitch) *
+               Mat4::rotation(Vec3(0, 1, 0), yaw) * Mat4::translation(Vec3(0, 0, 0) - spherePosition);
+    }
+};
+OrbitCamera orbit;
+int dragX = -1, dragY = -1;
+
+void updateOrbit(float dYaw, float dPitch, float zoom) {
+    {
+        std::lock_guard<std::mutex> lock(renderThreadMutex);
+        orbit.yaw += dYaw;
+        orbit.pitch = std::clamp(orbit.pitch + dPitch, -1.5f, 1.5f);
+        orbit.distance = std::clamp(orbit.distance * zoom, 2.5f, 100.0f);
+        scene.view = orbit.view();
+    }
+    requestWindowFrame();
+}
+
+void mouse(int button, int state, int x, int y) {
+    if (button == GLUT_LEFT_BUTTON) {
+        dragX = state == GLUT_DOWN ? x : -1;
+        dragY = y;
+    } else if (state == GLUT_DOWN && (button == 3 || button == 4)) { // wheel up / down
+        updateOrbit(0, 0, button == 3 ? 0.9f : 1.0f / 0.9f);
+    }
+}
+
+void motion(int x, int y) {
+    if (dragX < 0) return;
+    updateOrbit((x - dragX) * 0.01f, (y - dragY) * 0.01f, 1);
+    dragX = x;
+    dragY = y;
+}
+
+void special(int key, int, int) {
+    if (key == GLUT_KEY_LEFT) updateOrbit(-0.1f, 0, 1);
+    else if (key == GLUT_KEY_RIGHT) updateOrbit(0.1f, 0, 1);
+    else if (key == GLUT_KEY_UP) updateOrbit(0, -0.1f, 1);
+    else if (key == GLUT_KEY_DOWN) updateOrbit(0, 0.1f, 1);
+}
+
+void keyboard(unsigned char key, int, int) {
+    if (key == '+' || key == '=') updateOrbit(0, 0, 0.9f);
+    else if (key == '-') updateOrbit(0, 0, 1.0f / 0.9f);
+    else if (key == 'r') {
+        {
+            std::lock_guard<std::mutex> lock(renderThreadMutex);
+            orbit = OrbitCamera();
+        }
+        updateOrbit(0, 0, 1);
+    }
+}
+
+// Headless frame streaming: every completed frame goes to stdout or a FIFO as Y4M (4:4:4)
+// or raw top-down RGB24, for piping into an external encoder.
+enum class StreamFormat { None, Y4M, Raw };
+StreamFormat streamFormat = StreamFormat::None;
+const char* streamPath = "-";
+int streamFrames = 1;
+unsigned char yuvPlanes[3][HEIGHT][WIDTH];
+
+struct WriteChunk {
+    const void* data;
+    size_t size;
+};
+
+// Gathers the chunks into as few write calls as possible, straight from their source memory.
+bool writeChunks(int fd, WriteChunk* chunks, int count) {
+#ifdef _WIN32
+    for (int i = 0; i < count; ++i) {
+        const char* p = (const char*)chunks[i].data;
+        size_t left = chunks[i].size;
+        while (left > 0) {
+            int n = _write(fd, p, (unsigned)std::min(left, (size_t)1 << 30));
+            if (n <= 0) return false;
+            p += n; left -= n;
+        }
+    }
+    return true;
+#else
+    std::vector<iovec> iov(count);
+    for (int i = 0; i < count; ++i)
+        iov[i] = { const_cast<void*>(chunks[i].data), chunks[i].size };
+    iovec* next = iov.data();
+    int left = count;
+    while (left > 0) {
+        ssize_t n = writev(fd, next, std::min(left, IOV_MAX));
+        if (n < 0) return false;
+        while (left > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            ++next; --left;
+        }
+        if (left > 0) {
+            next->iov_base = (char*)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    return true;
+#endif
+}
+
+// BT.601 limited-range RGB -> YUV, eight pixels per iteration in 16-bit lanes.
+// The products are computed modulo 2^16 with a bias that keeps every sum non-negative.
+void convertToYuv(const uint32_t (*frame)[WIDTH]) {
+    static_assert(WIDTH % 8 == 0, "convertToYuv() converts eight pixels at a time");
+    const __m128i yR = _mm_set1_epi16(66), yG = _mm_set1_epi16(129), yB = _mm_set1_epi16(25);
+    const __m128i uR = _mm_set1_epi16(-38), uG = _mm_set1_epi16(-74), uB = _mm_set1_epi16(112);
+    const __m128i vR = _mm_set1_epi16(112), vG = _mm_set1_epi16(-94), vB = _mm_set1_epi16(-18);
+    const __m128i yBias = _mm_set1_epi16(128 + (16 << 8)), uvBias = _mm_set1_epi16((short)(128 + (128 << 8)));
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    auto channel = [&](__m128i lo, __m128i hi, int shift) {
+        return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, shift), byteMask), _mm_and_si128(_mm_srli_epi32(hi, shift), byteMask));
+    };
+    for (int y = 0; y < HEIGHT; ++y) {
+        const uint32_t* row = frame[HEIGHT - 1 - y];
+        for (int x = 0; x < WIDTH; x += 8) {
+            __m128i lo = _mm_load_si128((const __m128i*)(row + x)), hi = _mm_load_si128((const __m128i*)(row + x + 4));
+            __m128i r = channel(lo, hi, 0), g = channel(lo, hi, 8), b = channel(lo, hi, 16);
+            __m128i Y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, yR), _mm_mullo_epi16(g, yG)), _mm_add_epi16(_mm_mullo_epi16(b, yB), yBias));
+            __m128i U = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, uR), _mm_mullo_epi16(g, uG)), _mm_add_epi16(_mm_mullo_epi16(b, uB), uvBias));
+            __m128i V = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, vR), _mm_mullo_epi16(g, vG)), _mm_add_epi16(_mm_mullo_epi16(b, vB), uvBias));
+            __m128i zero = _mm_setzero_si128();
+            _mm_storel_epi64((__m128i*)&yuvPlanes[0][y][x], _mm_packus_epi16(_mm_srli_epi16(Y, 8), zero));
+            _mm_storel_epi64((__m128i*)&yuvPlanes[1][y][x], _mm_packus_epi16(_mm_srli_epi16(U, 8), zero));
+            _mm_storel_epi64((__m128i*)&yuvPlanes[2][y][x], _mm_packus_epi16(_mm_srli_epi16(V, 8), zero));
+        }
+    }
+}
+
+// Packs one framebuffer row to 3-byte RGB for the sinks that need it.
+void packRowRGB(const uint32_t* row, unsigned char* out) {
+    for (int x = 0; x < WIDTH; ++x) {
+        uint32_t px = row[x];
+        out[x * 3] = (unsigned char)px;
+        out[x * 3 + 1] = (unsigned char)(px >> 8);
+        out[x * 3 + 2] = (unsigned char)(px >> 16);
+    }
+}
+
+unsigned char rgbFrame[HEIGHT][WIDTH][3];
+
+bool writeStreamFrame(int fd, const uint32_t (*frame)[WIDTH]) {
+    if (streamFormat == StreamFormat::Y4M) {
+        convertToYuv(frame);
+        WriteChunk chunks[2] = { { "FRAME\n", 6 }, { yuvPlanes, sizeof(yuvPlanes) } };
+        return writeChunks(fd, chunks, 2);
+    }
+    // GL rows are bottom-up; packing them in reverse flips the image on the way.
+    for (int y = 0; y < HEIGHT; ++y)
+        packRowRGB(frame[HEIGHT - 1 - y], rgbFrame[y][0]);
+    WriteChunk chunk = { rgbFrame, sizeof(rgbFrame) };
+    return writeChunks(fd, &chunk, 1);
+}
+
+// Renders streamFrames frames on the render thread and writes each one while the next renders.
+int runStream() {
+    int fd = 1;
+    if (std::strcmp(streamPath, "-") != 0) {
+#ifdef _WIN32
+        fd = _open(streamPath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+        fd = open(streamPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (fd < 0) {
+            std::cerr << "Cannot open " << streamPath << "\n";
+            return 1;
+        }
+    }
+#ifdef _WIN32
+    else _setmode(fd, _O_BINARY);
+#endif
+    if (streamFormat == StreamFormat::Y4M) {
+        std::string header = "YUV4MPEG2 W" + std::to_string(WIDTH) + " H" + std::to_string(HEIGHT) + " F30:1 Ip A1:1 C444\n";
+        WriteChunk chunk = { header.data(), header.size() };
+        writeChunks(fd, &chunk, 1);
+    }
+
+    std::ofstream statsOut;
+    if (statsPath) {
+        statsOut.open(statsPath);
+        statsOut << "[";
+    }
+
+    startRenderThread();
+    requestFrame();
+    bool ok = true;
+    for (int i = 0; i < streamFrames && ok; ++i) {
+        while (!acquireFrame()) std::this_thread::yield();
+        if (i + 1 < streamFrames) requestFrame();
+        if (statsPath) writePipelineStatsEntry(statsOut, i, frameStats[presentBuffer]);
+        ok = writeStreamFrame(fd, frameBuffers[presentBuffer]);
+    }
+    stopRenderThread();
+    if (statsPath) statsOut << "\n]\n";
+    if (fd != 1) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+    if (!ok) std::cerr << "Frame stream write failed\n";
+    return ok ? 0 : 1;
+}
+
+// Batch mode: renders every job of a job file concurrently, one RenderTarget per worker.
+// One job per line as whitespace-separated key=value pairs; '#' starts a comment:
+//   output=frames/a.ppm light=-4,4,-3 material=green_plastic sphere=64x32 compact=1 shadows=1
+// mesh=SPEC picks another procedural mesh (see MeshSpec); ico=N is short for mesh=ico:N.
+// The output extension picks the format: .png or .qoi, otherwise PPM.
+struct BatchJob {
+    std::string output;
+    Vec3 lightPosition = Vec3(-4, 4, -3);
+    int material = 0;
+    MeshSpec mesh;
+    bool compact = false;
+    bool shadows = false;
+};
+
+const char* batchPath = nullptr;
+
+int findMaterial(std::string name) {
+    if (!name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+        int index = std::atoi(name.c_str());
+        return index < (int)materialRegistry.size() ? index : -1;
+    }
+    std::replace(name.begin(), name.end(), '_', ' ');
+    for (size_t i = 0; i < materialRegistry.size(); ++i)
+        if (name == materialRegistry[i].material.name) return (int)i;
+    return -1;
+}
+
+bool parseBatchFile(const char* path, std::vector<BatchJob>& jobs) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Cannot open batch file " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (int lineNo = 1; std::getline(in, line); ++lineNo) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream tokens(line);
+        BatchJob job;
+        bool any = false, ok = true;
+        for (std::string token; tokens >> token;) {
+            any = true;
+            size_t eq = token.find('=');
+            std::string key = token.substr(0, eq), value = eq == std::string::npos ? "" : token.substr(eq + 1);
+            if (key == "output") job.output = value;
+            else if (key == "light") ok = std::sscanf(value.c_str(), "%f,%f,%f", &job.lightPosition.x, &job.lightPosition.y, &job.lightPosition.z) == 3;
+            else if (key == "material") ok = (job.material = findMaterial(value)) >= 0;
+            else if (key == "compact") job.compact = value == "1";
+            else if (key == "shadows") job.shadows = value == "1";
+            else if (key == "mesh") ok = parseMeshSpec(value, job.mesh);
+            else if (key == "ico" || key == "sphere") ok = parseMeshSpec(key + ":" + value, job.mesh);
+            else ok = false;
+            if (!ok) break;
+        }
+        if (!any) continue;
+        if (!ok || job.output.empty()) {
+            std::cerr << path << ":" << lineNo << ": invalid job\n";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Writes a binary PPM, flipping GL's bottom-up rows to PPM's top-down order.
+bool writePPM(const char* path, const uint32_t (*frame)[WIDTH]) {
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << WIDTH << " " << HEIGHT << "\n255\n";
+    unsigned char row[WIDTH][3];
+    for (int y = HEIGHT - 1; y >= 0; --y) {
+        packRowRGB(frame[y], row[0]);
+        out.write((const char*)row, sizeof(row));
+    }
+    return (bool)out;
+}
+
+// A PPM file created at its final size and mapped, so resolveSamples() can write the pixels in place
+// through RenderTarget::ppmPixels. The pixels start out zero (black). Without mmap (Windows), open()
+// fails and callers fall back to writePPM().
+class MappedPPM {
+public:
+    ~MappedPPM() { close(); }
+
+    bool open(const char* path) {
+#ifdef _WIN32
+        (void)path;
+        return false;
+#else
+        std::string header = "P6\n" + std::to_string(WIDTH) + " " + std::to_string(HEIGHT) + "\n255\n";
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        size = header.size() + (size_t)WIDTH * HEIGHT * 3;
+        void* mapped = ftruncate(fd, (off_t)size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        base = (unsigned char*)mapped;
+        std::memcpy(base, header.data(), header.size());
+        pixels = base + header.size();
+        return true;
+#endif
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (base) munmap(base, size);
+#endif
+        base = pixels = nullptr;
+    }
+
+    unsigned char* pixels = nullptr; // top-down RGB rows after the header
+
+private:
+    unsigned char* base = nullptr;
+    size_t size = 0;
+};
+
+// PNG and QOI output, picked by file extension in batch mode.
+
+uint32_t crc32(const unsigned char* data, size_t n, uint32_t crc = 0) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t adler32(const unsigned char* data, size_t n) {
+    uint32_t a = 1, b = 0;
+    while (n > 0) {
+        size_t block = std::min<size_t>(n, 5552); // largest run before b can overflow
+        for (size_t i = 0; i < block; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521; b %= 65521;
+        data += block; n -= block;
+    }
+    return b << 16 | a;
+}
+
+// Deflate (RFC 1951) with the fixed Huffman code and greedy hash-chain matching. Each call
+// compresses one independent chunk: a non-final chunk ends with an empty stored block so it stops on
+// a byte boundary, and the chunks concatenate into one stream.
+void deflateChunk(const unsigned char* data, size_t n, bool last, std::vector<unsigned char>& out) {
+    static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const int distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const int distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    const int HASH_BITS = 15, WINDOW = 32768, MAX_MATCH = 258, MAX_CHAIN = 32;
+
+    uint32_t bits = 0;
+    int count = 0;
+    auto put = [&](uint32_t value, int n) { // LSB first
+        bits |= value << count;
+        for (count += n; count >= 8; count -= 8) {
+            out.push_back((unsigned char)bits);
+            bits >>= 8;
+        }
+    };
+    auto putCode = [&](uint32_t code, int n) { // Huffman codes go MSB first
+        uint32_t reversed = 0;
+        for (int i = 0; i < n; ++i) reversed |= ((code >> i) & 1) << (n - 1 - i);
+        put(reversed, n);
+    };
+    auto literal = [&](int sym) {
+        if (sym < 144) putCode(0x30 + sym, 8);
+        else if (sym < 256) putCode(0x190 + sym - 144, 9);
+        else if (sym < 280) putCode(sym - 256, 7);
+        else putCode(0xc0 + sym - 280, 8);
+    };
+
+    put(last ? 1 : 0, 1);
+    put(1, 2); // fixed Huffman block
+    std::vector<int> head(1 << HASH_BITS, -1), prev(n);
+    auto hash = [&](size_t i) { return (uint32_t)(data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u >> (32 - HASH_BITS); };
+    for (size_t i = 0; i < n;) {
+        int bestLen = 0, bestDist = 0;
+        if (i + 3 <= n) {
+            int maxLen = (int)std::min<size_t>(MAX_MATCH, n - i), chain = MAX_CHAIN;
+            for (int j = head[hash(i)]; j >= 0 && (int)i - j <= WINDOW && chain-- > 0; j = prev[j]) {
+                int len = 0;
+                while (len < maxLen && data[j + len] == data[i + len]) ++len;
+                if (len > bestLen) {
+                    bestLen = len;
+                    bestDist = (int)i - j;
+                    if (len == maxLen) break;
+                }
+            }
+        }
+        int step = 1;
+        if (bestLen >= 3) {
+            int l = 28, d = 29;
+            while (lengthBase[l] > bestLen) --l;
+            while (distBase[d] > bestDist) --d;
+            literal(257 + l);
+            put(bestLen - lengthBase[l], lengthExtra[l]);
+            putCode(d, 5);
+            put(bestDist - distBase[d], distExtra[d]);
+            step = bestLen;
+        } else {
+            literal(data[i]);
+        }
+        for (; step > 0; --step, ++i) {
+            if (i + 3 > n) continue;
+            uint32_t h = hash(i);
+            prev[i] = head[h];
+            head[h] = (int)i;
+        }
+    }
+    literal(256);
+    if (!last) {
+        put(0, 3); // empty stored block: BFINAL 0, BTYPE 00, then LEN 0 / NLEN 0xffff on a byte boundary
+        if (count > 0) put(0, 8 - count);
+        out.insert(out.end(), { 0, 0, 0xff, 0xff });
+    } else if (count > 0) {
+        put(0, 8 - count);
+    }
+}
+
+// One top-down PNG row as a filter byte plus the filtered RGB bytes, using the filter with the
+// smallest sum of absolute (signed) outputs.
+void filterRow(const uint32_t (*frame)[WIDTH], int y, unsigned char* out) {
+    unsigned char row[WIDTH * 3], up[WIDTH * 3] = {};
+    packRowRGB(frame[HEIGHT - 1 - y], row);
+    if (y > 0) packRowRGB(frame[HEIGHT - y], up);
+    auto paeth = [](int a, int b, int c) {
+        int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    };
+    unsigned char candidate[5][WIDTH * 3];
+    int best = 0;
+    long bestCost = std::numeric_limits<long>::max();
+    for (int f = 0; f < 5; ++f) {
+        long cost = 0;
+        for (int i = 0; i < WIDTH * 3; ++i) {
+            int a = i >= 3 ? row[i - 3] : 0, b = up[i], c = i >= 3 ? up[i - 3] : 0;
+            int predicted = f == 0 ? 0 : f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) / 2 : paeth(a, b, c);
+            candidate[f][i] = (unsigned char)(row[i] - predicted);
+            cost += std::abs((signed char)candidate[f][i]);
+        }
+        if (cost < bestCost) {
+            bestCost = cost;
+            best = f;
+        }
+    }
+    out[0] = (unsigned char)best;
+    std::memcpy(out + 1, candidate[best], WIDTH * 3);
+}
+
+// Rows are filtered and deflated in independent chunks of about 64 KB on the task pool, one task per
+// chunk. The FrameWriter thread joins only its own chunks (see TaskPool::wait()), so a batch runner
+// blocked in FrameWriter::submit() never waits on it; with --threads 1 the chunks run in order here.
+bool writePNG(const char* path, const uint32_t (*frame)[WIDTH]) {
+    const size_t stride = WIDTH * 3 + 1;
+    const int rowsPerChunk = std::max(1, (int)(65536 / stride)), chunks = (HEIGHT + rowsPerChunk - 1) / rowsPerChunk;
+    std::vector<unsigned char> filtered(stride * HEIGHT);
+    std::vector<std::vector<unsigned char>> deflated(chunks);
+    taskPool().parallelFor(0, chunks, 1, [&](size_t c0, size_t c1) {
+        for (size_t c = c0; c < c1; ++c) {
+            int y0 = (int)c * rowsPerChunk, y1 = std::min(HEIGHT, y0 + rowsPerChunk);
+            for (int y = y0; y < y1; ++y) filterRow(frame, y, &filtered[y * stride]);
+            deflateChunk(&filtered[y0 * stride], (y1 - y0) * stride, (int)c + 1 == chunks, deflated[c]);
+        }
+    });
+
+    auto be32 = [](std::vector<unsigned char>& v, uint32_t x) {
+        v.insert(v.end(), { (unsigned char)(x >> 24), (unsigned char)(x >> 16), (unsigned char)(x >> 8), (unsigned char)x });
+    };
+    std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    auto chunk = [&](const char* type, const std::vector<unsigned char>& data) {
+        be32(png, (uint32_t)data.size());
+        size_t start = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        be32(png, crc32(&png[start], png.size() - start));
+    };
+    std::vector<unsigned char> header;
+    be32(header, WIDTH);
+    be32(header, HEIGHT);
+    header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8-bit RGB, deflate, adaptive filters, no interlace
+    chunk("IHDR", header);
+    std::vector<unsigned char> zlib = { 0x78, 0x01 };
+    for (const auto& d : deflated) zlib.insert(zlib.end(), d.begin(), d.end());
+    be32(zlib, adler32(filtered.data(), filtered.size()));
+    chunk("IDAT", zlib);
+    chunk("IEND", {});
+
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char*)png.data(), png.size());
+    return (bool)out;
+}
+
+// QOI (qoiformat.org), 3 channels, sRGB.
+bool writeQOI(const char* path, const uint32_t (*frame)[WIDTH]) {
+    std::vector<unsigned char> out = { 'q', 'o', 'i', 'f' };
+    out.reserve(14 + (size_t)WIDTH * HEIGHT * 4 + 8);
+    for (uint32_t v : { (uint32_t)WIDTH, (uint32_t)HEIGHT })
+        out.insert(out.end(), { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v });
+    out.insert(out.end(), { 3, 0 });
+
+    uint32_t index[64] = {};
+    uint32_t prev = OPAQUE_ALPHA; // the format starts from opaque black
+    int run = 0;
+    for (int y = 0; y < HEIGHT; ++y) {
+        const uint32_t* row = frame[HEIGHT - 1 - y];
+        for (int x = 0; x < WIDTH; ++x) {
+            uint32_t px = row[x];
+            if (px == prev) {
+                if (++run == 62) {
+                    out.push_back((unsigned char)(0xc0 | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out.push_back((unsigned char)(0xc0 | (run - 1)));
+                run = 0;
+            }
+            int r = px & 0xff, g = (px >> 8) & 0xff, b = (px >> 16) & 0xff;
+            int h = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (index[h] == px) {
+                out.push_back((unsigned char)h);
+            } else {
+                index[h] = px;
+                int dr = (signed char)(r - (int)(prev & 0xff)), dg = (signed char)(g - (int)((prev >> 8) & 0xff)),
+                    db = (signed char)(b - (int)((prev >> 16) & 0xff));
+                int drg = dr - dg, dbg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                    out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+                    out.insert(out.end(), { (unsigned char)(0x80 | (dg + 32)), (unsigned char)((drg + 8) << 4 | (dbg + 8)) });
+                else
+                    out.insert(out.end(), { 0xfe, (unsigned char)r, (unsigned char)g, (unsigned char)b });
+            }
+            prev = px;
+        }
+    }
+    if (run > 0) out.push_back((unsigned char)(0xc0 | (run - 1)));
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*)out.data(), out.size());
+    return (bool)file;
+}
+
+using FrameEncoder = bool (*)(const char*, const uint32_t (*)[WIDTH]);
+
+// Encoders that run off the render path; PPM output is written in place by resolve instead.
+FrameEncoder encoderFor(const std::string& path) {
+    auto endsWith = [&](const char* ext) {
+        size_t n = std::strlen(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    if (endsWith(".png")) return writePNG;
+    if (endsWith(".qoi")) return writeQOI;
+    return nullptr;
+}
+
+// Encodes and writes frames on a background thread while the next frame renders. submit() blocks
+// once MAX_PENDING frames are queued, so a slow encoder cannot pile up frame buffers.
+class FrameWriter {
+public:
+    ~FrameWriter() { finish(); }
+
+    // A frame buffer to render into, recycled from frames already written when possible.
+    std::unique_ptr<FramePixels> acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (spare.empty()) return std::unique_ptr<FramePixels>(new FramePixels());
+        std::unique_ptr<FramePixels> frame = std::move(spare.back());
+        spare.pop_back();
+        return frame;
+    }
+
+    void submit(std::string path, FrameEncoder encode, std::unique_ptr<FramePixels> frame) {
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [this] { return queue.size() < MAX_PENDING; });
+        queue.push_back({ std::move(path), encode, std::move(frame) });
+        wake.notify_one();
+    }
+
+    // Writes everything queued and stops the thread; returns the number of failed writes.
+    int finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (thread.joinable()) thread.join();
+        return failures;
+    }
+
+private:
+    struct Job {
+        std::string path;
+        FrameEncoder encode;
+        std::unique_ptr<FramePixels> frame;
+    };
+    static const size_t MAX_PENDING = 4;
+
+    std::mutex mutex;
+    std::condition_variable wake, space;
+    std::deque<Job> queue;
+    std::vector<std::unique_ptr<FramePixels>> spare;
+    bool stopping = false;
+    int failures = 0;
+    std::thread thread{ [this] { run(); } };
+
+    void run() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            space.notify_one();
+            bool ok = job.encode(job.path.c_str(), job.frame->rows);
+            if (!ok) std::cerr << "Cannot write " << job.path << "\n";
+            std::lock_guard<std::mutex> lock(mutex);
+            failures += !ok;
+            spare.push_back(std::move(job.frame));
+        }
+    }
+};
+
+int runBatch() {
+    std::vector<BatchJob> jobs;
+    if (!parseBatchFile(batchPath, jobs)) return 1;
+
+    // Meshes are shared read-only between workers, one per distinct shape and tessellation.
+    using MeshKey = std::tuple<int, int, int>;
+    auto meshKey = [](const BatchJob& job) { return MeshKey((int)job.mesh.shape, job.mesh.a, job.mesh.b); };
+    std::map<MeshKey, Mesh> meshes;
+    std::map<MeshKey, CompactMesh> compactMeshes;
+    for (const BatchJob& job : jobs) {
+        Mesh& mesh = meshes[meshKey(job)];
+        if (mesh.indices.empty()) buildMesh(mesh, job.mesh);
+        if (job.compact && !compactMeshes.count(meshKey(job)))
+            compactMeshes[meshKey(job)] = compressMesh(mesh);
+    }
+
+    // One runner task per pool thread, each with its own render target, takes jobs in order; the
+    // stages of every render fork onto the same pool, and a runner waiting on them only helps with
+    // its own render.
+    auto start = std::chrono::steady_clock::now();
+    FrameWriter writer;
+    std::atomic<size_t> nextJob{ 0 };
+    std::atomic<int> failures{ 0 };
+    std::vector<PipelineStats> jobStats(jobs.size());
+    TaskPool& pool = taskPool();
+    int runners = (int)std::min<size_t>(pool.workerCount() + 1, jobs.size());
+    TaskGroup group;
+    for (int r = 0; r < runners; ++r) {
+        pool.submit([&] {
+            std::unique_ptr<RenderTarget> target(new RenderTarget);
+            std::unique_ptr<FramePixels> pixels(new FramePixels());
+            target->framebuffer = pixels->rows;
+            for (size_t i; (i = nextJob++) < jobs.size();) {
+                const BatchJob& job = jobs[i];
+                MeshKey key = meshKey(job);
+                Scene jobScene = { &meshes.at(key), job.compact ? &compactMeshes.at(key) : nullptr, job.material, job.lightPosition, job.shadows, sphereModel, Mat4() };
+                auto renderJob = [&] {
+                    render(*target, jobScene);
+                    jobStats[i] = getPipelineStats(*target);
+                };
+                if (FrameEncoder encode = encoderFor(job.output)) {
+                    std::unique_ptr<FramePixels> frame = writer.acquire();
+                    target->framebuffer = frame->rows;
+                    renderJob();
+                    target->framebuffer = pixels->rows;
+                    writer.submit(job.output, encode, std::move(frame));
+                    continue;
+                }
+                // Resolve straight into the mapped output file; debug views overwrite the framebuffer
+                // after resolve, so they take the copying path.
+                MappedPPM mapped;
+                if (debugView == DebugView::None && mapped.open(job.output.c_str())) {
+                    target->ppmPixels = mapped.pixels;
+                    renderJob();
+                    target->ppmPixels = nullptr;
+                    continue;
+                }
+                renderJob();
+                if (!writePPM(job.output.c_str(), target->framebuffer)) {
+                    std::cerr << "Cannot write " << job.output << "\n";
+                    ++failures;
+                }
+            }
+        }, group);
+    }
+    pool.wait(group);
+    failures += writer.finish();
+    if (statsPath) {
+        std::ofstream out(statsPath);
+        out << "[";
+        for (size_t i = 0; i < jobStats.size(); ++i) writePipelineStatsEntry(out, i, jobStats[i]);
+        out << "\n]\n";
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Rendered " << jobs.size() << " jobs on " << runners << " threads in " << ms << " ms\n";
+    return failures ? 1 : 0;
 }
 
 void initOpenGL() {
     glClearColor(0, 0, 0, 1);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, WIDTH); // dynamic resolution draws the top-left part of a frame
     glViewport(0, 0, WIDTH, HEIGHT);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -171,14 +2549,100 @@ void initOpenGL() {
     glLoadIdentity();
 }
 
+// Returns false when the options cannot run in this build.
+bool parseArgs(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--msaa") == 0 && i + 1 < argc)
+            msaaSamples = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--continuous") == 0)
+            continuousRendering = true;
+        else if (std::strcmp(argv[i], "--interactive") == 0) {
+            continuousRendering = true;
+            if (targetFrameMs <= 0) targetFrameMs = 1000.0f / 60;
+        }
+        else if (std::strcmp(argv[i], "--frame-ms") == 0 && i + 1 < argc)
+            targetFrameMs = (float)std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            if (std::strcmp(format, "y4m") == 0) streamFormat = StreamFormat::Y4M;
+            else if (std::strcmp(format, "raw") == 0) streamFormat = StreamFormat::Raw;
+            else std::cerr << "Unknown --stream " << format << "\n";
+        }
+        else if (std::strcmp(argv[i], "--stream-out") == 0 && i + 1 < argc)
+            streamPath = argv[++i];
+        else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            streamFrames = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--icosphere") == 0 && i + 1 < argc)
+            sceneMesh = { MeshShape::Icosphere, std::clamp(std::atoi(argv[++i]), 0, 8), 0 };
+        else if (std::strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            const char* spec = argv[++i];
+            if (!parseMeshSpec(spec, sceneMesh)) std::cerr << "Unknown --mesh " << spec << "\n";
+        }
+        else if (std::strcmp(argv[i], "--compact") == 0)
+            useCompactMesh = true;
+        else if (std::strcmp(argv[i], "--shadows") == 0)
+            scene.shadows = true;
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            poolThreads = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--pin") == 0)
+            poolPinning = true;
+        else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batchPath = argv[++i];
+        else if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            statsPath = argv[++i];
+        else if (std::strcmp(argv[i], "--view") == 0 && i + 1 < argc) {
+            const char* view = argv[++i];
+            if (std::strcmp(view, "bbox") == 0) debugView = DebugView::BBoxTests;
+            else if (std::strcmp(view, "overdraw") == 0) debugView = DebugView::Overdraw;
+            else if (std::strcmp(view, "shader") == 0) debugView = DebugView::ShaderInvocations;
+            else if (std::strcmp(view, "tiletime") == 0) debugView = DebugView::TileTime;
+            else std::cerr << "Unknown --view " << view << "\n";
+        }
+        else
+            std::cerr << "Unknown option " << argv[i] << "\n";
+    }
+    if (debugView != DebugView::None && !PIPELINE_STATS) {
+        std::cerr << "--view needs a build with PIPELINE_STATS=1, such as the Debug configuration\n";
+        return false;
+    }
+    // Streams and batch files hold full-size frames; only the window stretches a smaller one back.
+    if (targetFrameMs > 0 && (batchPath || streamFormat != StreamFormat::None)) {
+        std::cerr << "--frame-ms and --interactive only apply to the window, rendering at full resolution\n";
+        targetFrameMs = 0;
+    }
+    if (msaaSamples != 1 && msaaSamples != 4 && msaaSamples != 8) {
+        std::cerr << "Unsupported --msaa " << msaaSamples << ", using 4x\n";
+        msaaSamples = 4;
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
+    if (!parseArgs(argc, argv)) return 1;
+    registerDefaultMaterials();
+    buildMesh(sphereMesh, sceneMesh);
+    if (useCompactMesh) {
+        compactSphereMesh = compressMesh(sphereMesh);
+        scene.compactMesh = &compactSphereMesh;
+    }
+    if (batchPath)
+        return runBatch();
+    if (streamFormat != StreamFormat::None)
+        return runStream();
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
     glutInitWindowSize(WIDTH, HEIGHT);
     glutCreateWindow("Flat Shading");
     initOpenGL();
-    createSphere();
+    startRenderThread();
+    std::atexit(stopRenderThread);
+    requestWindowFrame();
     glutDisplayFunc(display);
+    glutMouseFunc(mouse);
+    glutMotionFunc(motion);
+    glutSpecialFunc(special);
+    glutKeyboardFunc(keyboard);
     glutMainLoop();
     return 0;
 }